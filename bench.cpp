@@ -0,0 +1,1028 @@
+/*
+HOW TO RUN?
+	g++ -O2 -pthread bench.cpp malloc_3.cpp -o bench
+	./bench
+
+	To compare the three implementations on the same workloads, build one binary
+	per implementation and run only the workload suite:
+
+	for m in malloc1 malloc2 malloc_3; do
+		g++ -O2 -pthread bench.cpp $m.cpp -o bench_$m && ./bench_$m workloads
+	done
+
+	"./bench_malloc_3 workloads fastbins" runs them with the fast bins of
+	malloc_3 on (M_FASTBIN_MAX).
+
+	The placement policy of malloc_3 is picked at compile time (see PLACEMENT
+	POLICY in malloc_3.cpp), so policies are compared the same way:
+
+	for fit in FirstFit NextFit BestFit AddressOrderedFit; do
+		g++ -O2 -pthread -DMALLOC_FIT=$fit bench.cpp malloc_3.cpp -o bench_$fit && ./bench_$fit workloads
+	done
+
+	To replay a trace recorded with smalloc_trace_start (malloc_3.h):
+
+	./bench replay trace.bin
+
+Every benchmark runs in a forked child (same trick as main.cpp) so it starts
+from a clean heap and does not disturb the benchmarks that follow it.
+
+malloc1 never frees and has no srealloc, and malloc2 is not thread safe and
+walks its whole list, so only the workload suite runs against them; the other
+benchmarks need smallopt and run against malloc_3 alone.
+The weak definitions below stand in for whatever the linked implementation
+lacks.
+
+NOTE: the numbers are wall-clock time (nanoseconds per call averaged over a
+      window of calls, or total throughput). run on an idle machine if you want
+      to compare between runs.
+ */
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include "malloc_3.h"
+
+/*******************************************************************************
+ *  FALLBACKS FOR THE SIMPLER IMPLEMENTATIONS
+ ******************************************************************************/
+
+__attribute__((weak)) void sfree(void*) {}
+__attribute__((weak)) void* scalloc(size_t num, size_t size) {
+    void* p = smalloc(num * size);
+    return p ? memset(p, 0, num * size) : nullptr;
+}
+/* malloc1 has no srealloc: this only allocates, so it never pays for a copy */
+__attribute__((weak)) void* srealloc(void*, size_t size) { return smalloc(size); }
+/* Ignores the alignment, so that a replay can still sfree the blocks of malloc1 and malloc2 */
+__attribute__((weak)) void* smemalign(size_t, size_t size) { return smalloc(size); }
+__attribute__((weak)) int smallopt(int, int) { return 0; }
+__attribute__((weak)) void sfree_sized(void* p, size_t) { sfree(p); }
+__attribute__((weak)) size_t susable_size(void*) { return 0; }
+__attribute__((weak)) size_t smalloc_batch(size_t, size_t, void**) { return 0; }
+__attribute__((weak)) void sfree_batch(void**, size_t) {}
+__attribute__((weak)) SRegion* sregion_create(size_t) { return nullptr; }
+__attribute__((weak)) void* sregion_alloc(SRegion*, size_t size) { return smalloc(size); }
+__attribute__((weak)) void sregion_reset(SRegion*) {}
+__attribute__((weak)) void sregion_destroy(SRegion*) {}
+__attribute__((weak)) size_t _num_meta_data_bytes() { return 0; }
+__attribute__((weak)) void sheap_info(HeapInfo* info) { memset(info, 0, sizeof(*info)); }
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Bench bookkeeping is mmap'ed so it never goes through the allocator under
+ * test, and pre-faulted so it does not show up in the RSS deltas. */
+template <typename T>
+static T* benchArray(size_t count) {
+    void* p = mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p == MAP_FAILED)
+        exit(1);
+    memset(p, 0, count * sizeof(T));
+    return static_cast<T*>(p);
+}
+
+static size_t residentBytes() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Writes one byte per page so the block is actually resident, like a caller
+ * that uses its memory would. */
+static void touch(void* p, size_t size) {
+    char* c = static_cast<char*>(p);
+    for (size_t i = 0; i < size; i += 4096)
+        c[i] = 1;
+    c[size - 1] = 1;
+}
+
+/*******************************************************************************
+ *  BENCHMARKS
+ ******************************************************************************/
+
+/* Grows the main heap to 10M blocks and, at every power of ten, measures the
+ * cost of appending a new block and of extending a freed wilderness block.
+ * Both paths depend on finding the tail of the block list, so they should stay
+ * flat as the number of blocks grows. The slabs are turned off so that the
+ * small blocks go to the heap. */
+void bench_tail_growth() {
+    smallopt(M_SLAB_MAX, 0);
+    const size_t WINDOW = 1000;
+    const size_t CHECKPOINTS[] = {1000, 10000, 100000, 1000000, 10000000};
+    size_t blocks = 0;
+
+    printf("%10s %16s %16s\n", "blocks", "append ns/call", "extend ns/call");
+    for (size_t checkpoint : CHECKPOINTS) {
+        while (blocks < checkpoint) {
+            if (!smalloc(16))
+                exit(1);
+            ++blocks;
+        }
+
+        double start = now_ns();
+        for (size_t i = 0; i < WINDOW; ++i)
+            smalloc(16);
+        double append = (now_ns() - start) / WINDOW;
+        blocks += WINDOW;
+
+        /* free the wilderness and ask for a bit more than it has each time */
+        size_t size = 16;
+        void* tail = smalloc(size);
+        start = now_ns();
+        for (size_t i = 0; i < WINDOW; ++i) {
+            sfree(tail);
+            size += 16;
+            tail = smalloc(size);
+        }
+        double extend = (now_ns() - start) / WINDOW;
+        ++blocks;
+
+        printf("%10zu %16.1f %16.1f\n", checkpoint, append, extend);
+    }
+}
+
+/* Each thread repeatedly allocates a batch of small blocks and frees them. */
+static void* thread_local_worker(void*) {
+    const int ROUNDS = 2000, BATCH = 64;
+    void* blocks[BATCH];
+    unsigned seed = (unsigned) (size_t) &blocks;
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < BATCH; ++i)
+            blocks[i] = smalloc(8 + rand_r(&seed) % 504);
+        for (int i = 0; i < BATCH; ++i)
+            sfree(blocks[i]);
+    }
+    return nullptr;
+}
+
+/* Single producer single consumer ring: the producer allocates, the consumer
+ * frees, so every block is freed by a different thread than allocated it. */
+struct Ring {
+    static const size_t CAPACITY = 1024;
+    void* slots[CAPACITY];
+    std::atomic<size_t> head, tail;
+};
+static const int PC_OBJECTS = 128000;
+
+static void* producer_worker(void* arg) {
+    Ring* ring = static_cast<Ring*>(arg);
+    unsigned seed = (unsigned) (size_t) ring;
+    for (int i = 0; i < PC_OBJECTS; ++i) {
+        void* p = smalloc(8 + rand_r(&seed) % 504);
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail - ring->head.load(std::memory_order_acquire) == Ring::CAPACITY)
+            sched_yield();
+        ring->slots[tail % Ring::CAPACITY] = p;
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+    return nullptr;
+}
+
+static void* consumer_worker(void* arg) {
+    Ring* ring = static_cast<Ring*>(arg);
+    for (int i = 0; i < PC_OBJECTS; ++i) {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        while (ring->tail.load(std::memory_order_acquire) == head)
+            sched_yield();
+        sfree(ring->slots[head % Ring::CAPACITY]);
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+    return nullptr;
+}
+
+/* Runs the thread local and the producer/consumer patterns on 1 to 64 threads
+ * and prints the total throughput. */
+static void run_thread_scaling(bool tcache, int arenas) {
+    const int THREADS[] = {1, 2, 4, 8, 16, 32, 64};
+    static Ring rings[32];
+    pthread_t tids[64];
+    smallopt(M_TCACHE, tcache);
+    smallopt(M_ARENAS, arenas);
+
+    printf("tcache %s, %d arena(s)\n%8s %20s %20s\n", tcache ? "on" : "off", arenas,
+           "threads", "local Mops/s", "prod/cons Mops/s");
+    for (int threads : THREADS) {
+        double start = now_ns();
+        for (int t = 0; t < threads; ++t)
+            pthread_create(&tids[t], nullptr, thread_local_worker, nullptr);
+        for (int t = 0; t < threads; ++t)
+            pthread_join(tids[t], nullptr);
+        double local = threads * 2000.0 * 64 * 2 / (now_ns() - start) * 1e3;
+
+        double pc = 0;
+        if (threads >= 2) {
+            start = now_ns();
+            for (int t = 0; t < threads / 2; ++t) {
+                rings[t].head = rings[t].tail = 0;
+                pthread_create(&tids[2 * t], nullptr, producer_worker, &rings[t]);
+                pthread_create(&tids[2 * t + 1], nullptr, consumer_worker, &rings[t]);
+            }
+            for (int t = 0; t < threads; ++t)
+                pthread_join(tids[t], nullptr);
+            pc = threads / 2 * PC_OBJECTS * 2.0 / (now_ns() - start) * 1e3;
+        }
+        printf("%8d %20.2f %20.2f\n", threads, local, pc);
+    }
+}
+
+void bench_thread_scaling() {
+    run_thread_scaling(false, 1);
+    run_thread_scaling(true, 1);
+    run_thread_scaling(false, 8);
+    run_thread_scaling(true, 8);
+}
+
+/* Allocates a million tiny objects, then churns them with random frees and
+ * allocations. Reports the time and the peak RSS, with and without slabs. */
+static void run_small_churn(int slab_max) {
+    const int LIVE = 1000000, CHURN = 4000000;
+    smallopt(M_SLAB_MAX, slab_max);
+    void** objects = static_cast<void**>(smalloc(LIVE * sizeof(void*)));
+    unsigned seed = 1;
+
+    double start = now_ns();
+    for (int i = 0; i < LIVE; ++i)
+        objects[i] = smalloc(8 + rand_r(&seed) % 57);
+    for (int i = 0; i < CHURN; ++i) {
+        int k = rand_r(&seed) % LIVE;
+        sfree(objects[k]);
+        objects[k] = smalloc(8 + rand_r(&seed) % 57);
+    }
+    double elapsed = (now_ns() - start) / (LIVE + 2.0 * CHURN);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%10s %12.1f %14ld %16zu\n", slab_max ? "on" : "off", elapsed,
+           usage.ru_maxrss, _num_meta_data_bytes() / 1024);
+}
+
+void bench_small_churn_slab() { run_small_churn(256); }
+void bench_small_churn_no_slab() { run_small_churn(0); }
+
+/* Frees small blocks in batches with sfree or sfree_sized (thread cache on),
+ * then grows 1000 buffers like vectors, appending 24 byte elements and
+ * calling srealloc for 1.5 times the size when the capacity runs out: the
+ * capacity is what was asked for, or susable_size with the sized API. */
+static void run_sized(bool sized) {
+    const int BATCH = 1000, ROUNDS = 4000, BUFFERS = 1000, APPENDS = 2000;
+    smallopt(M_TCACHE, 1);
+    void** objects = static_cast<void**>(smalloc(BATCH * sizeof(void*)));
+    size_t* sizes = static_cast<size_t*>(smalloc(BATCH * sizeof(size_t)));
+    unsigned seed = 1;
+
+    double free_ns = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = 0; i < BATCH; ++i)
+            objects[i] = smalloc(sizes[i] = 8 + rand_r(&seed) % 57);
+        double start = now_ns();
+        for (int i = 0; i < BATCH; ++i) {
+            if (sized)
+                sfree_sized(objects[i], sizes[i]);
+            else
+                sfree(objects[i]);
+        }
+        free_ns += now_ns() - start;
+    }
+
+    size_t reallocs = 0;
+    double start = now_ns();
+    for (int b = 0; b < BUFFERS; ++b) {
+        char* buffer = nullptr;
+        size_t capacity = 0;
+        for (size_t used = 24; used <= 24 * APPENDS; used += 24) {
+            if (used > capacity) {
+                buffer = static_cast<char*>(srealloc(buffer, used + used / 2));
+                capacity = sized ? susable_size(buffer) : used + used / 2;
+                ++reallocs;
+            }
+            buffer[used - 1] = 1;
+        }
+        sfree(buffer);
+    }
+    printf("%10s %14.1f %14zu %14.1f\n", sized ? "on" : "off",
+           free_ns / ((double) BATCH * ROUNDS), reallocs / BUFFERS,
+           (now_ns() - start) / 1e6);
+}
+
+void bench_sized_on() { run_sized(true); }
+void bench_sized_off() { run_sized(false); }
+
+/* Allocates the nodes of a packet, 500 blocks of the same size, and frees
+ * them all together, with one call per block or with smalloc_batch and
+ * sfree_batch. Reports ns per block for a slab size and a heap size. */
+static void run_batch(bool batch) {
+    const int NODES = 500, PACKETS = 4000;
+    void* nodes[NODES];
+    printf("%10s", batch ? "on" : "off");
+    for (size_t size : {48, 400}) {
+        double start = now_ns();
+        for (int packet = 0; packet < PACKETS; ++packet) {
+            if (batch) {
+                if (smalloc_batch(size, NODES, nodes) != (size_t) NODES)
+                    exit(1);
+            } else {
+                for (int i = 0; i < NODES; ++i)
+                    nodes[i] = smalloc(size);
+            }
+            for (int i = 0; i < NODES; ++i)
+                *static_cast<char*>(nodes[i]) = 1;
+            if (batch) {
+                sfree_batch(nodes, NODES);
+            } else {
+                for (int i = 0; i < NODES; ++i)
+                    sfree(nodes[i]);
+            }
+        }
+        printf(" %14.1f", (now_ns() - start) / ((double) NODES * PACKETS));
+    }
+    printf("\n");
+}
+
+void bench_batch_on() { run_batch(true); }
+void bench_batch_off() { run_batch(false); }
+
+/* Serves requests that allocate 60 objects of 16 to 256 bytes and a 2 KiB
+ * buffer, which all die when the request ends, with smalloc and sfree or
+ * with a region that is reset after every request. Reports ns per object. */
+static void run_region(bool region) {
+    const int OBJECTS = 60, REQUESTS = 200000;
+    void* objects[OBJECTS + 1];
+    SRegion* pool = region ? sregion_create(0) : nullptr;
+    unsigned seed = 1;
+
+    double start = now_ns();
+    for (int request = 0; request < REQUESTS; ++request) {
+        for (int i = 0; i <= OBJECTS; ++i) {
+            size_t size = i == OBJECTS ? 2048 : 16 + rand_r(&seed) % 241;
+            objects[i] = region ? sregion_alloc(pool, size) : smalloc(size);
+            *static_cast<char*>(objects[i]) = 1;
+        }
+        if (region) {
+            sregion_reset(pool);
+        } else {
+            for (int i = 0; i <= OBJECTS; ++i)
+                sfree(objects[i]);
+        }
+    }
+    printf("%10s %14.1f\n", region ? "on" : "off",
+           (now_ns() - start) / ((OBJECTS + 1.0) * REQUESTS));
+    sregion_destroy(pool);
+}
+
+void bench_region_on() { run_region(true); }
+void bench_region_off() { run_region(false); }
+
+/* Frees and allocates again blocks of 272 to 1008 bytes, over the slab
+ * sizes, out of 1000 live ones: each free is followed by a request of the
+ * same size, with and without the fast bins. Reports ns per free/malloc pair. */
+static void run_pingpong(bool fastbins) {
+    const int LIVE = 1000, PAIRS = 4000000;
+    smallopt(M_FASTBIN_MAX, fastbins ? 1008 : 0);
+    void* blocks[LIVE];
+    size_t sizes[LIVE];
+    unsigned seed = 1;
+    for (int i = 0; i < LIVE; ++i)
+        blocks[i] = smalloc(sizes[i] = 272 + rand_r(&seed) % 737);
+
+    double start = now_ns();
+    for (int i = 0; i < PAIRS; ++i) {
+        int k = rand_r(&seed) % LIVE;
+        sfree(blocks[k]);
+        blocks[k] = smalloc(sizes[k]);
+    }
+    printf("%10s %14.1f\n", fastbins ? "on" : "off", (now_ns() - start) / PAIRS);
+}
+
+void bench_pingpong_fast() { run_pingpong(true); }
+void bench_pingpong_slow() { run_pingpong(false); }
+
+/* Allocates 200000 blocks of 272 to 1008 bytes, over the slab sizes, into an
+ * empty heap, which grows by exactly what is missing or in growth steps
+ * (M_HEAP_GROWTH). Reports ns per call and how many times the heap grew. */
+static void run_growth(bool steps) {
+    const int BLOCKS = 200000;
+    smallopt(M_HEAP_GROWTH, steps ? 128 * 1024 : 0);
+    unsigned seed = 1;
+
+    double start = now_ns();
+    for (int i = 0; i < BLOCKS; ++i)
+        if (!smalloc(272 + rand_r(&seed) % 737))
+            exit(1);
+    double elapsed = (now_ns() - start) / BLOCKS;
+
+    HeapInfo info;
+    sheap_info(&info);
+    printf("%10s %12.1f %12zu %12zu\n", steps ? "on" : "off", elapsed,
+           info.heap_grows, info.heap_grows_saved);
+}
+
+void bench_growth_steps() { run_growth(true); }
+void bench_growth_exact() { run_growth(false); }
+
+/* Allocates 200 zeroed buffers of 16 KiB to 1 MiB that are never touched,
+ * with scalloc, which skips the memory it knows reads as zeros, or with
+ * smalloc and memset, as scalloc did before. Reports ns per call and the
+ * memory the buffers made resident. */
+static void run_calloc(bool known_zero) {
+    const int BUFFERS = 200;
+    void** buffers = benchArray<void*>(BUFFERS);
+    unsigned seed = 1;
+    size_t start = residentBytes();
+
+    double begin = now_ns();
+    for (int i = 0; i < BUFFERS; ++i) {
+        size_t size = (16 + rand_r(&seed) % 1009) * 1024;
+        if (known_zero) {
+            buffers[i] = scalloc(1, size);
+        } else {
+            buffers[i] = smalloc(size);
+            memset(buffers[i], 0, size);
+        }
+    }
+    double elapsed = (now_ns() - begin) / BUFFERS;
+    printf("%10s %14.1f %14zu\n", known_zero ? "on" : "off", elapsed,
+           (residentBytes() - start) / 1024);
+    for (int i = 0; i < BUFFERS; ++i)
+        sfree(buffers[i]);
+}
+
+void bench_calloc_known_zero() { run_calloc(true); }
+void bench_calloc_memset() { run_calloc(false); }
+
+/* A spike then idle pattern: fills the heap with 200 MiB of 4 KiB blocks,
+ * frees every other one and then the rest from the bottom up, so a large free
+ * block grows inside the heap before it reaches the top, and prints the
+ * resident memory after each step with trimming on and off. */
+static void run_spike(bool trim) {
+    const int BLOCKS = 50000;
+    smallopt(M_SLAB_MAX, 0);
+    smallopt(M_TRIM_THRESHOLD, trim ? 128 * 1024 : 0);
+    smallopt(M_MADVISE_THRESHOLD, trim ? 256 * 1024 : 0);
+    void** blocks = benchArray<void*>(BLOCKS);
+    size_t start = residentBytes();
+
+    for (int i = 0; i < BLOCKS; ++i)
+        touch(blocks[i] = smalloc(4096), 4096);
+    size_t peak = residentBytes() - start;
+    double begin = now_ns();
+    for (int i = 0; i < BLOCKS; i += 2)
+        sfree(blocks[i]);
+    size_t half = residentBytes() - start;
+    for (int i = 1; i < BLOCKS; i += 2)
+        sfree(blocks[i]);
+    double elapsed = (now_ns() - begin) / BLOCKS;
+    size_t idle = residentBytes() - start;
+
+    HeapInfo info;
+    sheap_info(&info);
+    printf("%6s %12zu %12zu %12zu %12.1f %14zu %14zu\n", trim ? "on" : "off",
+           peak / 1024, half / 1024, idle / 1024, elapsed,
+           info.trimmed_bytes / 1024, info.madvised_bytes / 1024);
+}
+
+void bench_spike_trim() { run_spike(true); }
+void bench_spike_no_trim() { run_spike(false); }
+
+/* Doubles a buffer from 128 KiB up to the largest size smalloc accepts, once
+ * with srealloc and once by allocating, copying and freeing, and prints the
+ * time of each step. The new part of the buffer is written between steps,
+ * outside the timed region, so both variants have a fully resident buffer to
+ * move. */
+void bench_large_growth() {
+    const size_t MAX_SIZE = 100000000;
+    char* grown = static_cast<char*>(smalloc(128 * 1024));
+    char* copied = static_cast<char*>(smalloc(128 * 1024));
+    touch(grown, 128 * 1024);
+    touch(copied, 128 * 1024);
+
+    printf("%12s %16s %16s\n", "size KiB", "srealloc us", "copy us");
+    for (size_t size = 128 * 1024; size < MAX_SIZE;) {
+        size_t old_size = size;
+        size = std::min(2 * size, MAX_SIZE);
+
+        double start = now_ns();
+        grown = static_cast<char*>(srealloc(grown, size));
+        double realloc_us = (now_ns() - start) / 1e3;
+
+        start = now_ns();
+        char* bigger = static_cast<char*>(smalloc(size));
+        memcpy(bigger, copied, old_size);
+        sfree(copied);
+        copied = bigger;
+        double copy_us = (now_ns() - start) / 1e3;
+
+        if (!grown || !copied)
+            exit(1);
+        touch(grown + old_size, size - old_size);
+        touch(copied + old_size, size - old_size);
+        printf("%12zu %16.1f %16.1f\n", size / 1024, realloc_us, copy_us);
+    }
+}
+
+/* Dependent random 8 byte reads over four 96 MB tables, the kind of access
+ * that misses the TLB on every load with 4 KiB pages. Prints the time per read and how much
+ * of the process is backed by transparent huge pages. */
+static void run_random_access(int hugepages) {
+    const int TABLES = 4, READS = 20000000;
+    const size_t SIZE = 96 * 1000 * 1000, WORDS = SIZE / sizeof(uint64_t);
+    smallopt(M_HUGEPAGES, hugepages);
+    uint64_t* tables[TABLES];
+    for (int t = 0; t < TABLES; ++t) {
+        tables[t] = static_cast<uint64_t*>(smalloc(SIZE));
+        if (!tables[t])
+            exit(1);
+        for (size_t i = 0; i < WORDS; ++i)
+            tables[t][i] = i;
+    }
+
+    uint64_t x = 88172645463325252ULL, sum = 0;
+    double start = now_ns();
+    for (int i = 0; i < READS; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        /* the next address depends on this read, so the misses do not overlap */
+        uint64_t word = tables[x % TABLES][(x >> 8) % WORDS];
+        sum += word;
+        x += word & 1;
+    }
+    double elapsed = (now_ns() - start) / READS;
+
+    long huge_kib = 0;
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    while (f && fgets(line, sizeof(line), f))
+        sscanf(line, "AnonHugePages: %ld kB", &huge_kib);
+    if (f)
+        fclose(f);
+    printf("%10d %12.1f %16ld %20llu\n", hugepages, elapsed, huge_kib / 1024,
+           (unsigned long long) sum);
+}
+
+void bench_random_access_default() { run_random_access(0); }
+void bench_random_access_huge() { run_random_access(1); }
+
+/*******************************************************************************
+ *  WORKLOADS
+ ******************************************************************************/
+
+/* Standard allocator workloads that only use smalloc, sfree and srealloc, so
+ * they run against all three implementations. Every call is timed on its own
+ * (the clock_gettime overhead, ~20ns, is included in the samples), and each
+ * workload prints one row: throughput of the timed calls, latency percentiles,
+ * peak RSS, and the fragmentation at its point of steady state, which is the
+ * share of the memory it made resident that does not hold live payload. */
+
+static const size_t MAX_SAMPLES = 1 << 21;
+static const int LIVE = 10000;      // live blocks of the churn and batch workloads
+static const int OPS = 200000;      // calls of the churn and batch workloads
+
+static uint32_t* samples;
+static size_t sample_count;
+static double timed_ns;
+static size_t live_bytes;
+static size_t rss_start;
+static double fragmentation;
+
+static void record(double start) {
+    double elapsed = now_ns() - start;
+    timed_ns += elapsed;
+    if (sample_count < MAX_SAMPLES)
+        samples[sample_count] = (uint32_t) elapsed;
+    ++sample_count;
+}
+
+static void* timedMalloc(size_t size) {
+    double start = now_ns();
+    void* p = smalloc(size);
+    record(start);
+    if (!p)
+        exit(1);
+    touch(p, size);
+    live_bytes += size;
+    return p;
+}
+
+static void timedFree(void* p, size_t size) {
+    double start = now_ns();
+    sfree(p);
+    record(start);
+    live_bytes -= size;
+}
+
+static void* timedRealloc(void* p, size_t old_size, size_t size) {
+    double start = now_ns();
+    void* q = srealloc(p, size);
+    record(start);
+    if (!q)
+        exit(1);
+    touch(q, size);
+    live_bytes += size - old_size;
+    return q;
+}
+
+static void startWorkload() {
+    samples = benchArray<uint32_t>(MAX_SAMPLES);
+    sample_count = 0;
+    timed_ns = 0;
+    live_bytes = 0;
+    fragmentation = 0;
+    rss_start = residentBytes();
+}
+
+/* Called by a workload when its heap is at steady state, with the most live
+ * data it will hold. */
+static void measureFragmentation() {
+    size_t resident = residentBytes() - rss_start;
+    fragmentation = resident > live_bytes ? 1.0 - (double) live_bytes / resident : 0;
+}
+
+static double percentile(size_t count, double p) {
+    size_t k = std::min(count - 1, (size_t) (count * p));
+    std::nth_element(samples, samples + k, samples + count);
+    return samples[k];
+}
+
+static void printWorkloadHeader() {
+    printf("%-16s %10s %10s %10s %10s %14s %8s\n", "workload", "Mops/s",
+           "p50 ns", "p99 ns", "p999 ns", "peak RSS KiB", "frag %");
+}
+
+static void finishWorkload() {
+    size_t count = std::min(sample_count, MAX_SAMPLES);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf(" %10.2f %10.0f %10.0f %10.0f %14ld %8.1f\n",
+           sample_count / timed_ns * 1e3, percentile(count, 0.5),
+           percentile(count, 0.99), percentile(count, 0.999),
+           usage.ru_maxrss, fragmentation * 100);
+}
+
+static size_t uniformSize(unsigned* seed) {
+    return 8 + rand_r(seed) % 505;
+}
+
+/* Pareto distributed (alpha 1.2) from 16 bytes, capped at 64 KiB: mostly
+ * small blocks with a long tail of large ones. */
+static size_t powerLawSize(unsigned* seed) {
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    double size = 16 / pow(u, 1 / 1.2);
+    return size < 64 * 1024 ? (size_t) size : 64 * 1024;
+}
+
+/* Keeps LIVE blocks and replaces a random one on every step. */
+static void churn(size_t (*sizeOf)(unsigned*)) {
+    startWorkload();
+    void** blocks = benchArray<void*>(LIVE);
+    size_t* sizes = benchArray<size_t>(LIVE);
+    unsigned seed = 1;
+
+    for (int i = 0; i < LIVE; ++i)
+        blocks[i] = timedMalloc(sizes[i] = sizeOf(&seed));
+    for (int i = 0; i < OPS / 2; ++i) {
+        int k = rand_r(&seed) % LIVE;
+        timedFree(blocks[k], sizes[k]);
+        blocks[k] = timedMalloc(sizes[k] = sizeOf(&seed));
+    }
+    measureFragmentation();
+    for (int i = 0; i < LIVE; ++i)
+        timedFree(blocks[i], sizes[i]);
+    finishWorkload();
+}
+
+void work_uniform_random() { churn(uniformSize); }
+void work_power_law_random() { churn(powerLawSize); }
+
+/* Allocates LIVE blocks and frees them all, newest first (LIFO) or oldest
+ * first (FIFO), for as many rounds as fit in OPS. */
+static void batches(bool lifo) {
+    startWorkload();
+    void** blocks = benchArray<void*>(LIVE);
+    size_t* sizes = benchArray<size_t>(LIVE);
+    unsigned seed = 1;
+
+    for (int round = 0; round < OPS / (2 * LIVE); ++round) {
+        for (int i = 0; i < LIVE; ++i)
+            blocks[i] = timedMalloc(sizes[i] = uniformSize(&seed));
+        measureFragmentation();
+        for (int i = 0; i < LIVE; ++i) {
+            int k = lifo ? LIVE - 1 - i : i;
+            timedFree(blocks[k], sizes[k]);
+        }
+    }
+    finishWorkload();
+}
+
+void work_lifo() { batches(true); }
+void work_fifo() { batches(false); }
+
+/* Grows 1000 buffers side by side from 16 bytes to 16 KiB by a factor of 1.5,
+ * like vectors that are appended to in turns, so every srealloc has a
+ * neighbour in the way. */
+void work_realloc_chain() {
+    const int CHAINS = 1000, ROUNDS = 2;
+    const size_t MAX_SIZE = 16 * 1024;
+    startWorkload();
+    void** blocks = benchArray<void*>(CHAINS);
+    size_t* sizes = benchArray<size_t>(CHAINS);
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int c = 0; c < CHAINS; ++c)
+            blocks[c] = timedMalloc(sizes[c] = 16);
+        for (size_t size = 24; size <= MAX_SIZE; size += size / 2) {
+            for (int c = 0; c < CHAINS; ++c) {
+                blocks[c] = timedRealloc(blocks[c], sizes[c], size);
+                sizes[c] = size;
+            }
+        }
+        measureFragmentation();
+        for (int c = 0; c < CHAINS; ++c)
+            timedFree(blocks[c], sizes[c]);
+    }
+    finishWorkload();
+}
+
+/* Keeps 16 blocks of 128 KiB to 512 KiB, over the mmap threshold of
+ * malloc_3, and replaces a random one on every step. */
+void work_mmap_large() {
+    const int BLOCKS = 16, STEPS = 250;
+    startWorkload();
+    void* blocks[BLOCKS];
+    size_t sizes[BLOCKS];
+    unsigned seed = 1;
+
+    for (int i = 0; i < BLOCKS; ++i)
+        blocks[i] = timedMalloc(sizes[i] = (128 + rand_r(&seed) % 385) * 1024);
+    for (int i = 0; i < STEPS; ++i) {
+        int k = rand_r(&seed) % BLOCKS;
+        timedFree(blocks[k], sizes[k]);
+        blocks[k] = timedMalloc(sizes[k] = (128 + rand_r(&seed) % 385) * 1024);
+    }
+    measureFragmentation();
+    for (int i = 0; i < BLOCKS; ++i)
+        timedFree(blocks[i], sizes[i]);
+    finishWorkload();
+}
+
+struct Workload {
+    const char* name;
+    void (*func)();
+};
+
+static const Workload WORKLOADS[] = {
+    {"uniform_random", work_uniform_random},
+    {"power_law", work_power_law_random},
+    {"lifo", work_lifo},
+    {"fifo", work_fifo},
+    {"realloc_chain", work_realloc_chain},
+    {"mmap_large", work_mmap_large},
+};
+
+/*******************************************************************************
+ *  TRACE REPLAY
+ ******************************************************************************/
+
+/* Replays a trace recorded with smalloc_trace_start on a single thread, in
+ * time order, mapping every recorded address to the block the replay got for
+ * it. Calls that failed when recorded are skipped, as are frees and reallocs
+ * of addresses the trace never returned (a trace started mid-run). Reports the
+ * same latencies as the workloads, the peak growth of the heap (sbrk(0) for
+ * malloc1 and malloc2, HeapInfo::heap_bytes for malloc_3), and the
+ * fragmentation at the peak footprint: the share of the heap growth plus the
+ * live blocks of 128 KiB and up (which malloc_3 mmaps) that is not live
+ * payload. */
+
+static const char* replay_path;
+
+struct ReplaySlot {
+    uint64_t recorded;      // 0 is an empty slot, 1 a deleted one
+    void* p;
+    size_t size;
+};
+
+static ReplaySlot* replay_slots;
+static size_t replay_mask;
+
+static ReplaySlot* replayFind(uint64_t recorded, bool insert) {
+    ReplaySlot* deleted = nullptr;
+    for (size_t i = (recorded >> 4) * 0x9E3779B97F4A7C15ULL;; ++i) {
+        ReplaySlot* slot = &replay_slots[i & replay_mask];
+        if (slot->recorded == recorded)
+            return slot;
+        if (slot->recorded == 1 && !deleted)
+            deleted = slot;
+        if (slot->recorded == 0) {
+            if (!insert)
+                return nullptr;
+            slot = deleted ? deleted : slot;
+            slot->recorded = recorded;
+            return slot;
+        }
+    }
+}
+
+void bench_replay() {
+    int fd = open(replay_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t) st.st_size < sizeof(TRACE_MAGIC) - 1) {
+        printf("cannot read %s\n", replay_path);
+        exit(1);
+    }
+    char* file = static_cast<char*>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (file == MAP_FAILED || memcmp(file, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1)) {
+        printf("%s is not a trace\n", replay_path);
+        exit(1);
+    }
+    size_t count = (st.st_size - (sizeof(TRACE_MAGIC) - 1)) / sizeof(TraceRecord);
+    TraceRecord* records = benchArray<TraceRecord>(count + 1);
+    memcpy(records, file + sizeof(TRACE_MAGIC) - 1, count * sizeof(TraceRecord));
+    std::sort(records, records + count, [](const TraceRecord& a, const TraceRecord& b) {
+        return a.time < b.time;
+    });
+
+    size_t capacity = 1024;
+    while (capacity < 2 * count)
+        capacity *= 2;
+    replay_slots = benchArray<ReplaySlot>(capacity);
+    replay_mask = capacity - 1;
+
+    startWorkload();
+    char* brk_start = static_cast<char*>(sbrk(0));
+    HeapInfo info;
+    sheap_info(&info);
+    size_t heap_start = info.heap_bytes;
+    size_t large_live = 0, peak_heap = 0, peak_footprint = 0, peak_live = 0;
+    size_t skipped = 0, threads = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const TraceRecord& r = records[i];
+        threads = std::max(threads, (size_t) r.thread);
+        ReplaySlot* old = nullptr;
+        if (r.op == TRACE_FREE || (r.op == TRACE_REALLOC && r.old_address)) {
+            old = replayFind(r.old_address ? r.old_address : r.address, false);
+            if (!old) {
+                ++skipped;
+                if (r.op == TRACE_FREE)
+                    continue;
+            }
+        }
+        if (r.op != TRACE_FREE && !r.address) {
+            ++skipped;
+            continue;
+        }
+
+        void* p = nullptr;
+        double start = now_ns();
+        switch (r.op) {
+            case TRACE_MALLOC: p = smalloc(r.size); break;
+            case TRACE_CALLOC: p = scalloc(1, r.size); break;
+            case TRACE_REALLOC: p = srealloc(old ? old->p : nullptr, r.size); break;
+            case TRACE_MEMALIGN: p = smemalign(r.old_address, r.size); break;
+            case TRACE_FREE: sfree(old->p); break;
+        }
+        record(start);
+
+        if (old) {
+            live_bytes -= old->size;
+            large_live -= old->size >= 128 * 1024 ? old->size : 0;
+            old->recorded = 1;
+            old->p = nullptr;
+        }
+        if (r.op != TRACE_FREE && p) {
+            ReplaySlot* slot = replayFind(r.address, true);
+            if (slot->p) {  // the recorded free of the previous owner was out of order
+                live_bytes -= slot->size;
+                large_live -= slot->size >= 128 * 1024 ? slot->size : 0;
+            }
+            slot->p = p;
+            slot->size = r.size;
+            live_bytes += r.size;
+            large_live += r.size >= 128 * 1024 ? r.size : 0;
+        }
+
+        sheap_info(&info);
+        size_t heap = static_cast<char*>(sbrk(0)) - brk_start + info.heap_bytes - heap_start;
+        peak_heap = std::max(peak_heap, heap);
+        if (heap + large_live > peak_footprint) {
+            peak_footprint = heap + large_live;
+            peak_live = live_bytes;
+        }
+    }
+    if (peak_footprint > peak_live)
+        fragmentation = 1.0 - (double) peak_live / peak_footprint;
+
+    printf("%zu records from %zu threads, %zu skipped, %.1f ms in the allocator\n",
+           count, threads, skipped, timed_ns / 1e6);
+    printf("peak heap growth %zu KiB, peak footprint %zu KiB, live at peak %zu KiB\n",
+           peak_heap / 1024, peak_footprint / 1024, peak_live / 1024);
+    printWorkloadHeader();
+    printf("%-16s", "replay");
+    finishWorkload();
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static void callBenchFunction(void (*func)()) {
+    fflush(stdout);
+    if (!fork()) {  // bench as son, to get a clear heap
+        func();
+        fflush(stdout);
+        exit(0);
+    } else {		// father waits for son before continuing to next bench
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            printf("*** FAILED with exit status %d\n", exit_status);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2 && !strcmp(argv[1], "replay")) {
+        replay_path = argv[2];
+        callBenchFunction(bench_replay);
+        return 0;
+    }
+    bool only_workloads = argc > 1 && !strcmp(argv[1], "workloads");
+    bool has_smallopt = smallopt(M_TCACHE, 0);
+    if (only_workloads && argc > 2 && !strcmp(argv[2], "fastbins"))
+        smallopt(M_FASTBIN_MAX, 1008);
+
+    if (!only_workloads && has_smallopt) {
+        printf("bench_tail_growth\n");
+        callBenchFunction(bench_tail_growth);
+        printf("bench_thread_scaling\n");
+        callBenchFunction(bench_thread_scaling);
+        printf("bench_small_churn\n%10s %12s %14s %16s\n", "slabs", "ns/call",
+               "peak RSS KiB", "metadata KiB");
+        callBenchFunction(bench_small_churn_slab);
+        callBenchFunction(bench_small_churn_no_slab);
+        printf("bench_sized\n%10s %14s %14s %14s\n", "sized", "free ns/call",
+               "reallocs/buf", "growth ms");
+        callBenchFunction(bench_sized_off);
+        callBenchFunction(bench_sized_on);
+        printf("bench_batch\n%10s %14s %14s\n", "batch", "48 B ns/block",
+               "400 B ns/block");
+        callBenchFunction(bench_batch_off);
+        callBenchFunction(bench_batch_on);
+        printf("bench_region\n%10s %14s\n", "region", "ns/object");
+        callBenchFunction(bench_region_off);
+        callBenchFunction(bench_region_on);
+        printf("bench_pingpong\n%10s %14s\n", "fastbins", "ns/pair");
+        callBenchFunction(bench_pingpong_slow);
+        callBenchFunction(bench_pingpong_fast);
+        printf("bench_growth\n%10s %12s %12s %12s\n", "steps", "ns/call",
+               "grows", "grows saved");
+        callBenchFunction(bench_growth_exact);
+        callBenchFunction(bench_growth_steps);
+        printf("bench_calloc\n%10s %14s %14s\n", "known zero", "ns/call",
+               "resident KiB");
+        callBenchFunction(bench_calloc_memset);
+        callBenchFunction(bench_calloc_known_zero);
+        printf("bench_spike\n%6s %12s %12s %12s %12s %14s %14s\n", "trim",
+               "peak KiB", "half KiB", "idle KiB", "free ns", "trimmed KiB",
+               "madvised KiB");
+        callBenchFunction(bench_spike_trim);
+        callBenchFunction(bench_spike_no_trim);
+        printf("bench_large_growth\n");
+        callBenchFunction(bench_large_growth);
+        printf("bench_random_access\n%10s %12s %16s %20s\n", "hugepages",
+               "ns/read", "THP MiB", "checksum");
+        callBenchFunction(bench_random_access_default);
+        callBenchFunction(bench_random_access_huge);
+    }
+    printf("bench_workloads\n");
+    printWorkloadHeader();
+    for (const Workload& w : WORKLOADS) {
+        printf("%-16s", w.name);
+        callBenchFunction(w.func);
+    }
+    return 0;
+}
@@ -11,7 +11,7 @@ void* smalloc(size_t size){
 		return nullptr;
 	}
 
-	int status = sbrk(size);
+	void* status = sbrk(size);
 	if (status == (void*)-1){
 		return nullptr;
 	}
@@ -14,6 +14,12 @@ struct MallocMetadata {
 MallocMetadata* list_head = nullptr;
 size_t size_of_metadata = sizeof(MallocMetadata);
 
+/* Running totals, updated by smalloc and sfree so the statistics functions don't walk the list */
+size_t num_blocks = 0;
+size_t num_bytes = 0;
+size_t num_free_blocks = 0;
+size_t num_free_bytes = 0;
+
 void* smalloc(size_t size){
     if(size==0||size>=100000000) {
         return nullptr;
@@ -28,6 +34,8 @@ void* smalloc(size_t size){
         list_head->prev = nullptr;
         list_head->size = size;
         list_head->is_free = false;
+        num_blocks++;
+        num_bytes += size;
         return  (char*)head + size_of_metadata;
 
     }
@@ -36,6 +44,8 @@ void* smalloc(size_t size){
         while (it->next){
             if(it->size>=size && it->is_free){
                 it->is_free=false;
+                num_free_blocks--;
+                num_free_bytes -= it->size;
                 return (char*)it + size_of_metadata ;
             }
             it=it->next;
@@ -43,6 +53,8 @@ void* smalloc(size_t size){
         }
         if (it->size>=size && it->is_free){
             it->is_free=false;
+            num_free_blocks--;
+            num_free_bytes -= it->size;
             return (char*)it + size_of_metadata ;
 
         }
@@ -56,6 +68,8 @@ void* smalloc(size_t size){
             it->next->size=size;
             it->next->is_free= false;
             it->next->prev=it ;
+            num_blocks++;
+            num_bytes += size;
             return (char*)it->next+size_of_metadata ;
 
         }
@@ -86,7 +100,12 @@ void sfree(void* p){
         return;
     }
     MallocMetadata* to_free =(MallocMetadata*)((char*) p - size_of_metadata);
+    if(to_free->is_free){
+        return;
+    }
     to_free->is_free=true ;
+    num_free_blocks++;
+    num_free_bytes += to_free->size;
     return;
 }
 
@@ -105,7 +124,7 @@ void* srealloc(void* oldp, size_t size){
         if (!new_data){
             return nullptr;
         }
-        std::memcpy(new_data, oldp, size);
+        std::memcpy(new_data, oldp, old_metadata->size);
         sfree(oldp);
         return new_data;
     }
@@ -115,62 +134,48 @@ void* srealloc(void* oldp, size_t size){
 }
 
 
-size_t _num_free_blocks(){
-    if(!list_head){
-        return 0;
-    }
-    MallocMetadata* it=list_head;
-    size_t num_free = 0;
-    while (it){
+#ifdef MALLOC_DEBUG
+/* Walks the list and asserts that the running totals match it. Compile with -DMALLOC_DEBUG to run it
+ * on every statistics query. */
+static void statsCheck(){
+    size_t blocks = 0, bytes = 0, free_blocks = 0, free_bytes = 0;
+    for(MallocMetadata* it=list_head; it; it=it->next){
+        blocks++;
+        bytes+=it->size;
         if(it->is_free){
-            num_free++;
+            free_blocks++;
+            free_bytes+=it->size;
         }
-        it=it->next;
     }
-    return  num_free ;
+    assert(blocks == num_blocks);
+    assert(bytes == num_bytes);
+    assert(free_blocks == num_free_blocks);
+    assert(free_bytes == num_free_bytes);
+}
+#else
+static void statsCheck(){}
+#endif
+
+size_t _num_free_blocks(){
+    statsCheck();
+    return num_free_blocks ;
 }
 
 
 size_t _num_free_bytes(){
-    if(!list_head){
-        return 0;
-    }
-    MallocMetadata* it=list_head;
-    size_t num_free_bytes = 0;
-    while (it){
-        if(it->is_free){
-            num_free_bytes+=it->size;
-        }
-        it=it->next;
-    }
+    statsCheck();
     return num_free_bytes ;
 }
 
 size_t _num_allocated_blocks(){
-    if(!list_head){
-        return 0;
-    }
-    MallocMetadata* it=list_head;
-    size_t num_alo = 0;
-    while (it){
-        num_alo++;
-        it=it->next;
-    }
-    return  num_alo ;
+    statsCheck();
+    return num_blocks ;
 }
 
 
 size_t _num_allocated_bytes(){
-    if(!list_head){
-        return 0;
-    }
-    MallocMetadata* it=list_head;
-    size_t num_alo_bytes = 0;
-    while (it){
-        num_alo_bytes+=it->size;
-        it=it->next;
-    }
-    return  num_alo_bytes ;
+    statsCheck();
+    return num_bytes ;
 }
 
 size_t _num_meta_data_bytes(){
@@ -2,502 +2,3019 @@
 #include <stdio.h>
 #include <assert.h>
 #include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <algorithm>
+#include "malloc_3.h"
 
 #define KILO 1024
-#define HIST_SIZE 128
+#define SMALL_BINS 64
+#define SMALL_BIN_WIDTH 16
+#define HIST_SCAN_LIMIT 8
+#define TCACHE_CLASSES SMALL_BINS
+#define TCACHE_MAGAZINE 32
+#define FASTBIN_CLASSES SMALL_BINS
+#define FASTBIN_CONSOLIDATE (64 * KILO) // fast bin bytes of an arena that trigger a consolidation
+#define MAX_ARENAS 64
+#define HEAP_GROWTH_MAX (16 * KILO * KILO) // the growth step of a heap doubles up to this, see M_HEAP_GROWTH
+#define ARENA_SIZE (256 * KILO * KILO)
+#define MAIN_HEAP_SIZE ((size_t) 64 * KILO * KILO * KILO) // address space the main arena reserves, halved until it can
+#define SLAB_PAGE_SIZE (4 * KILO)
+#define SLAB_REGION_SIZE (KILO * KILO * KILO)
+#define SLAB_CLASSES 17 // slot sizes 16, 32, ..., 256 (class 0 is unused)
+#define TRACE_BUFFER_RECORDS 1024
+#define OS_PAGE_SIZE (4 * KILO)
+#define HUGE_PAGE_SIZE (2 * KILO * KILO)
+#ifdef MALLOC_PRELOAD
+#define MAX_REQUEST (SIZE_MAX >> 2) // as malloc, anything mmap can map
+#else
+#define MAX_REQUEST 100000000
+#endif
 
+/***
+ * The header of every arena and mmap block. The payload starts right after it.
+ *
+ * The low bits of size are flags (sizes are multiples of 16). prev_size is the boundary tag of the
+ * physically previous block: it is only written while that block is free, which PREV_FREE_BIT tells.
+ * Free blocks keep their bin links (FreeLinks) at the start of their payload, so allocated blocks
+ * carry nothing but these 16 bytes, and neighbors are found by address arithmetic alone.
+ */
 struct MallocMetadata {
+    size_t prev_size ;
     size_t size ;
-    bool is_free ;
-    MallocMetadata* next ;
-    MallocMetadata* prev ;
+};
+
+struct FreeLinks {
     MallocMetadata* next2;
     MallocMetadata* prev2;
 };
 
-MallocMetadata* hist[128] = {};
-MallocMetadata* list_head = nullptr;
-MallocMetadata* mmap_list_head = nullptr;
-size_t size_of_metadata = sizeof(MallocMetadata);
+/* mmap'ed blocks are linked together by a MmapLinks placed right before their header. */
+struct MmapLinks {
+    MallocMetadata* next;
+    MallocMetadata* prev;
+};
+
+#define FREE_BIT 1
+#define PREV_FREE_BIT 2
+#define MMAP_BIT 4
+#define ZERO_BIT 8 // on a free block: its payload reads as zeros after the FreeLinks
+#define FLAG_BITS 15
+#define MIN_PAYLOAD sizeof(FreeLinks)
+#define MMAP_HEADER_SIZE (sizeof(MmapLinks) + sizeof(MallocMetadata))
+#define REGION_HUGETLB 1 // in prev_size of an mmap'ed block: the region was mapped with MAP_HUGETLB
+
+/************* PLACEMENT POLICY *************/
+/* What is worth tuning about where blocks go is a template parameter of HeapPolicy: the fit (how
+ * hist_search picks among the free blocks), the bin layout (how many bins every power of two from 1 KiB
+ * up is split into), the smallest remainder worth splitting off a block, and the size from which blocks
+ * get a mapping of their own. The allocator is compiled with one instantiation, Policy, chosen with build
+ * flags, so nothing is dispatched at run time:
+ *
+ *     g++ -DMALLOC_FIT=BestFit -DMALLOC_LARGE_BIN_SPLIT=8 -DMALLOC_SPLIT_MIN=64 -DMALLOC_MMAP_THRESHOLD=262144 ...
+ *
+ * The heap is global to the process, so a binary holds a single policy; bench.cpp compares them with a
+ * binary per policy. */
+struct Arena;
+
+namespace { // the policy types, like the static functions, are not visible outside this file
+
+/* The fits. search() takes a block of at least size bytes out of the bins, or returns NULL. Only the bin
+ * of the size and the first non empty bin above it are looked at: any block of the latter fits. */
+struct FirstFit {           // the first fitting block, scanning at most HIST_SCAN_LIMIT blocks of the size's bin
+    static const bool roving = false;
+    static MallocMetadata* search(Arena* arena, size_t size);
+};
+
+struct NextFit {            // like FirstFit, but each bin is scanned from where the last search took a block
+    static const bool roving = true;
+    static MallocMetadata* search(Arena* arena, size_t size);
+};
+
+struct BestFit {            // the smallest fitting block
+    static const bool roving = false;
+    static MallocMetadata* search(Arena* arena, size_t size);
+};
+
+struct AddressOrderedFit {  // the fitting block with the lowest address
+    static const bool roving = false;
+    static MallocMetadata* search(Arena* arena, size_t size);
+};
+
+template <class Fit, int LargeBinSplit, size_t SplitMin, size_t MmapThreshold>
+struct HeapPolicy {
+    static_assert(LargeBinSplit >= 1 && LargeBinSplit <= 16 && !(LargeBinSplit & (LargeBinSplit - 1)),
+                  "the large bins split a power of two into 1, 2, 4, 8 or 16 bins");
+    static_assert(SplitMin >= sizeof(FreeLinks) && SplitMin % 16 == 0, "a split remainder holds its links");
+    static_assert(MmapThreshold >= 4096, "the fast bins and the thread cache come from the heap");
+    typedef Fit fit;
+    static const int large_bin_split = LargeBinSplit;
+    static const int large_bin_split_log = __builtin_ctz(LargeBinSplit);
+    static const size_t split_min = SplitMin;           // smallest free remainder a block is split for
+    static const size_t mmap_threshold = MmapThreshold; // requests of this size and more are mmap'ed
+    /* The large bins cover every size below twice the mmap threshold, and below 64 MiB for the mmap
+     * cache, so a request never lands in the last bin, which also takes everything larger. The count is
+     * rounded up to whole bitmap words. */
+    static const size_t bins_cover = 2 * MmapThreshold > (size_t) 64 * KILO * KILO ? 2 * MmapThreshold
+                                                                                   : (size_t) 64 * KILO * KILO;
+    static const int hist_size = (SMALL_BINS + (63 - __builtin_clzll(bins_cover) - 10) * LargeBinSplit + 63) / 64 * 64;
+};
+
+}
+
+#ifndef MALLOC_FIT
+#define MALLOC_FIT FirstFit
+#endif
+#ifndef MALLOC_LARGE_BIN_SPLIT
+#define MALLOC_LARGE_BIN_SPLIT 4
+#endif
+#ifndef MALLOC_SPLIT_MIN
+#define MALLOC_SPLIT_MIN 128
+#endif
+#ifndef MALLOC_MMAP_THRESHOLD
+#define MALLOC_MMAP_THRESHOLD (128 * KILO)
+#endif
+typedef HeapPolicy<MALLOC_FIT, MALLOC_LARGE_BIN_SPLIT, MALLOC_SPLIT_MIN, MALLOC_MMAP_THRESHOLD> Policy;
+
+#define HIST_SIZE Policy::hist_size
+static_assert(HIST_SIZE <= HEAP_INFO_BINS, "HeapInfo has a bin per hist bin");
+
+/***
+ * Running totals of an arena's blocks, kept up to date by every function that creates, resizes,
+ * merges or frees a block so the statistics functions never walk the heap. The free counters follow
+ * the histogram: a block counts as free while it is in a bin.
+ */
+struct HeapStats {
+    size_t blocks;
+    size_t bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t trimmed_bytes;   // given back by moving the top of the heap down
+    size_t madvised_bytes;  // given back with madvise from inside free blocks
+    size_t grows;           // times the heap grew (at most an mprotect call each)
+    size_t grows_saved;     // blocks handed out past the highest one so far without growing
+};
+
+struct SlabPage;
+
+/***
+ * An independent heap: its own histogram, its own blocks and its own lock, and its own slabs under a
+ * second lock so that small requests do not wait for the heap. Every arena lives in an
+ * address range it reserved PROT_NONE with mmap, aligned to ARENA_SIZE, and grows by moving top towards
+ * end and committing the pages top reaches. Arena 0 is the main arena: its struct is a global and its
+ * range, of up to MAIN_HEAP_SIZE bytes, is reserved on the first allocation. The others are ARENA_SIZE
+ * bytes and start with the Arena struct itself. Nothing depends on the program break, so the heaps do
+ * not collide with other users of brk. The blocks of an arena are laid out back to back from list_head
+ * up to top.
+ */
+struct Arena {
+    MallocMetadata* hist[HIST_SIZE];
+    uint64_t hist_bitmap[HIST_SIZE / 64]; // bit i is set iff hist[i] is not empty
+    size_t bin_blocks[HIST_SIZE];           // length of hist[i]
+    size_t bin_bytes[HIST_SIZE];            // total size of the blocks in hist[i]
+    MallocMetadata* fastbins[FASTBIN_CLASSES]; // freed blocks of 16*i bytes, not coalesced yet
+    size_t fast_bytes;                      // total size of the blocks in fastbins
+    MallocMetadata* rover;     // where NextFit resumes: a block in the bins or NULL
+    MallocMetadata* list_head;
+    MallocMetadata* list_tail; // the wilderness block
+    char* top;
+    char* end;
+    char* committed;           // the pages up to here are read/write, the rest of the range PROT_NONE
+    size_t grow_step;          // the next growth, 0 until the first one, see heapGrow
+    char* used_end;            // the end of the highest block handed out, for grows_saved
+    HeapStats stats;
+    unsigned char index;
+    pthread_mutex_t lock;
+    SlabPage* slab_partial[SLAB_CLASSES]; // pages of each class with a free slot
+    size_t slab_pages[SLAB_CLASSES];      // pages of each class
+    size_t slab_used[SLAB_CLASSES];       // slots of each class handed out
+    pthread_mutex_t slab_lock;            // guards the three above, never held with lock
+};
+
+static Arena main_arena = { {}, {}, {}, {}, {}, 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0, nullptr, {}, 0,
+                            PTHREAD_MUTEX_INITIALIZER, {}, {}, {}, PTHREAD_MUTEX_INITIALIZER };
+static Arena* arenas[MAX_ARENAS] = { &main_arena };
+static int arena_count = 1;           // how many arenas threads are spread over
+static bool arena_per_cpu = false;    // pick the arena by sched_getcpu() instead of round robin
+static unsigned arena_next = 0;       // round robin counter
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local Arena* thread_arena = nullptr;
+
+static MallocMetadata* mmap_list_head = nullptr;
+static size_t mmap_blocks = 0;        // length of the mmap list
+static size_t mmap_bytes = 0;         // total payload of the mmap list
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t size_of_metadata = sizeof(MallocMetadata);
+static size_t trim_threshold = 128 * KILO;    // free wilderness that gets trimmed, 0 never trims
+static size_t madvise_threshold = 256 * KILO; // free interior blocks that get madvised, 0 never madvises
+static int hugepage_mode = 0;                 // see M_HUGEPAGES
+static size_t fastbin_max = 0;                // largest block kept in the fast bins, see M_FASTBIN_MAX
+static size_t heap_growth = 128 * KILO;       // the smallest step the heaps grow by, 0 grows by what is missing
+
+class LockGuard {
+public:
+    explicit LockGuard(pthread_mutex_t* lock) : lock(lock) { pthread_mutex_lock(lock); }
+    ~LockGuard() { pthread_mutex_unlock(lock); }
+private:
+    pthread_mutex_t* lock;
+};
+
+/************* BLOCK HEADERS *************/
+static size_t blockSize(MallocMetadata* block){
+    return block->size & ~(size_t) FLAG_BITS;
+}
+
+static bool isFree(MallocMetadata* block){
+    return block->size & FREE_BIT;
+}
+
+static bool isMmap(MallocMetadata* block){
+    return block->size & MMAP_BIT;
+}
+
+static bool isZero(MallocMetadata* block){
+    return block->size & ZERO_BIT;
+}
+
+static void setSize(MallocMetadata* block, size_t size){
+    block->size = size | (block->size & FLAG_BITS);
+}
+
+static FreeLinks* freeLinks(MallocMetadata* block){
+    return (FreeLinks*) ((char*) block + size_of_metadata);
+}
+
+static MmapLinks* mmapLinks(MallocMetadata* block){
+    return (MmapLinks*) ((char*) block - sizeof(MmapLinks));
+}
+
+static MallocMetadata* headerOf(void* p){
+    return (MallocMetadata*) ((char*) p - size_of_metadata);
+}
+
+static void* payloadOf(MallocMetadata* block){
+    return (char*) block + size_of_metadata;
+}
+
+/***
+ * Rounds a request up to a payload size that keeps the next header, and so every payload, 16 bytes
+ * aligned and can hold the FreeLinks once the block is freed.
+ */
+static size_t alignSize(size_t size){
+    size = (size + 15) & ~(size_t) 15;
+    return size < MIN_PAYLOAD ? MIN_PAYLOAD : size;
+}
+
+static char* pageUp(char* p){
+    return (char*) (((uintptr_t) p + OS_PAGE_SIZE - 1) & ~(uintptr_t) (OS_PAGE_SIZE - 1));
+}
+
+static char* pageDown(char* p){
+    return (char*) ((uintptr_t) p & ~(uintptr_t) (OS_PAGE_SIZE - 1));
+}
+
+/***
+ * @return The block right after the given one in the arena or NULL if it is the wilderness.
+ */
+static MallocMetadata* nextBlock(Arena* arena, MallocMetadata* block){
+    char* next = (char*) block + size_of_metadata + blockSize(block);
+    return next < arena->top ? (MallocMetadata*) next : nullptr;
+}
+
+/***
+ * @return The block right before the given one if it is free (found through the boundary tag), NULL
+ * otherwise.
+ */
+static MallocMetadata* prevFreeBlock(MallocMetadata* block){
+    if (!(block->size & PREV_FREE_BIT)){
+        return nullptr;
+    }
+    return (MallocMetadata*) ((char*) block - block->prev_size - size_of_metadata);
+}
+
+/***
+ * Marks a block free and writes its boundary tag into the next block.
+ */
+static void markFree(Arena* arena, MallocMetadata* block){
+    block->size |= FREE_BIT;
+    MallocMetadata* next = nextBlock(arena, block);
+    if (next){
+        next->prev_size = blockSize(block);
+        next->size |= PREV_FREE_BIT;
+    }
+}
+
+static void markUsed(Arena* arena, MallocMetadata* block){
+    block->size &= ~(size_t) (FREE_BIT | ZERO_BIT);
+    MallocMetadata* next = nextBlock(arena, block);
+    if (next){
+        next->size &= ~(size_t) PREV_FREE_BIT;
+    }
+}
+
+/************* ARENAS *************/
+/***
+ * Reserves size bytes of address space aligned to ARENA_SIZE. Nothing is committed: the range is
+ * PROT_NONE and MAP_NORESERVE until arenaGrow makes its pages read/write.
+ *
+ * @return The range or NULL if it could not be mapped.
+ */
+static char* arenaReserve(size_t size){
+    char* region = (char*) mmap(nullptr, size + ARENA_SIZE, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (region == (void*) -1){
+        return nullptr;
+    }
+    char* aligned = (char*) (((uintptr_t) region + ARENA_SIZE - 1) & ~(uintptr_t) (ARENA_SIZE - 1));
+    if (aligned != region){
+        munmap(region, aligned - region);
+    }
+    munmap(aligned + size, region + ARENA_SIZE - aligned);
+    return aligned;
+}
+
+/***
+ * Moves the end of an arena's heap, the way sbrk moves the program break. Growing commits the pages top
+ * reaches with mprotect, advised with MADV_HUGEPAGE in huge page mode. The heap only shrinks to a page
+ * boundary, and the pages past it are decommitted by mapping them PROT_NONE again, which drops them and
+ * gives their commit charge back. The main arena reserves its range on its first growth.
+ *
+ * @return The previous end of the heap or (void*) -1 on failure.
+ */
+static void* arenaGrow(Arena* arena, intptr_t diff){
+    if (!arena->top){
+        size_t size = MAIN_HEAP_SIZE;
+        char* region = arenaReserve(size);
+        while (!region && size > ARENA_SIZE){
+            size /= 2;
+            region = arenaReserve(size);
+        }
+        if (!region){
+            return (void*) -1;
+        }
+        arena->top = arena->committed = region;
+        arena->end = region + size;
+    }
+    if (diff > arena->end - arena->top){
+        return (void*) -1;
+    }
+    char* old_top = arena->top;
+    char* page = pageUp(old_top + diff);
+    if (page > arena->committed){
+        if (mprotect(arena->committed, page - arena->committed, PROT_READ | PROT_WRITE) != 0){
+            return (void*) -1;
+        }
+        if (hugepage_mode){
+            madvise(arena->committed, page - arena->committed, MADV_HUGEPAGE);
+        }
+        arena->committed = page;
+    } else if (page < arena->committed){
+        if (mmap(page, arena->committed - page, PROT_NONE, MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0) != (void*) -1){
+            arena->committed = page;
+        } else {
+            madvise(page, arena->committed - page, MADV_DONTNEED);
+        }
+    }
+    arena->top = old_top + diff;
+    return old_top;
+}
+
+/***
+ * Grows an arena by at least need bytes, and by its growth step if that is more, so that a run of
+ * misses costs a handful of mprotect calls instead of one each; the caller keeps what it does not need as
+ * the wilderness. The step starts at heap_growth and doubles with every growth up to HEAP_GROWTH_MAX,
+ * and starts over when the heap is trimmed. The caller must hold the arena's lock.
+ *
+ * @param grown: Set to how many bytes the arena grew by.
+ * @return The previous top of the arena or (void*) -1 on failure.
+ */
+static void* heapGrow(Arena* arena, size_t need, size_t* grown){
+    *grown = 0;
+    if (!need){
+        return arena->top;
+    }
+    size_t step = heap_growth ? std::max(arena->grow_step, heap_growth) : 0;
+    void* old_top = (void*) -1;
+    if (step > need){
+        old_top = arenaGrow(arena, step);
+    }
+    if (old_top == (void*) -1){
+        /******** Too close to the end of the arena for a whole step, or steps are off ********/
+        step = need;
+        old_top = arenaGrow(arena, need);
+        if (old_top == (void*) -1){
+            return old_top;
+        }
+    }
+    if (heap_growth){
+        size_t max_step = std::max(heap_growth, (size_t) HEAP_GROWTH_MAX);
+        arena->grow_step = std::min(std::max(arena->grow_step, heap_growth) * 2, max_step);
+    }
+    arena->stats.grows++;
+    *grown = step;
+    return old_top;
+}
+
+/***
+ * Records that a block ending at end was handed out. One that ends past every block handed out before
+ * would have needed the heap to grow if it did not grow in steps.
+ */
+static void heapUsed(Arena* arena, char* end, bool grew){
+    if (end > arena->used_end){
+        if (!grew){
+            arena->stats.grows_saved++;
+        }
+        arena->used_end = end;
+    }
+}
+
+/***
+ * Maps and initializes arenas[index]. The region is aligned to ARENA_SIZE so arenaOf() can find
+ * the arena of a block by masking its address.
+ *
+ * @return The arena or NULL if the region could not be mapped.
+ */
+static Arena* arenaCreate(int index){
+    char* aligned = arenaReserve(ARENA_SIZE);
+    if (!aligned){
+        return nullptr;
+    }
+    char* top = aligned + ((sizeof(Arena) + 15) & ~(size_t) 15);
+    if (mprotect(aligned, pageUp(top) - aligned, PROT_READ | PROT_WRITE) != 0){
+        munmap(aligned, ARENA_SIZE);
+        return nullptr;
+    }
+
+    Arena* arena = (Arena*) aligned;
+    arena->index = index;
+    arena->top = top;
+    arena->end = aligned + ARENA_SIZE;
+    arena->committed = pageUp(top);
+    pthread_mutex_init(&arena->lock, nullptr);
+    pthread_mutex_init(&arena->slab_lock, nullptr);
+    /******** Published last: threadArena reads arenas[] without arenas_lock ********/
+    __atomic_store_n(&arenas[index], arena, __ATOMIC_RELEASE);
+    return arena;
+}
+
+/***
+ * Returns the arena that owns a (non mmap'ed) block: the main arena if the block is in its heap,
+ * otherwise the arena whose aligned region contains it.
+ */
+static Arena* arenaOf(MallocMetadata* block){
+    if ((char*) block >= (char*) main_arena.list_head && (char*) block < main_arena.top){
+        return &main_arena;
+    }
+    return (Arena*) ((uintptr_t) block & ~(uintptr_t) (ARENA_SIZE - 1));
+}
+
+/***
+ * Returns arenas[index], creating it if it does not exist yet. Only creation takes arenas_lock.
+ *
+ * @return The arena, or the main arena if it could not be created.
+ */
+static Arena* arenaGet(int index){
+    Arena* arena = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+    if (arena){
+        return arena;
+    }
+    LockGuard guard(&arenas_lock);
+    arena = arenas[index] ? arenas[index] : arenaCreate(index);
+    return arena ? arena : &main_arena;
+}
+
+/***
+ * Returns the arena the calling thread allocates from. Threads are assigned to the first arena_count
+ * arenas round robin when they first allocate, or by the CPU they run on when arena_per_cpu is set, in
+ * which case the arena is looked up on every call without taking a lock. Arenas are created lazily; if
+ * that fails the thread uses the main arena.
+ */
+static Arena* threadArena(){
+    if (arena_per_cpu){
+        int cpu = sched_getcpu();
+        return arenaGet(cpu < 0 ? 0 : cpu % arena_count);
+    }
+    if (!thread_arena){
+        thread_arena = arenaGet(__atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED) % arena_count);
+    }
+    return thread_arena;
+}
+
+static void listInsertToTail(Arena* arena, MallocMetadata* entry){
+    if ( arena->list_head == nullptr ){
+        arena->list_head = entry;
+    }
+    arena->list_tail = entry;
+}
+
+/***
+ * Returns the wilderness block (the last block of the arena's heap). The tail is
+ * kept up to date by every function that appends, splits or merges blocks, so
+ * this never walks the heap.
+ */
+static MallocMetadata* listGetTail(Arena* arena){
+    return arena->list_tail;
+}
+
+
+/***
+ * Maps a block size to its bin in the histogram.
+ *
+ * Sizes below 1024 get a bin per 16 bytes (bins 0-63). Above that every power of two is split into
+ * Policy::large_bin_split bins (example with 4: sizes 1024-1279 go in bin 64, sizes 1280-1535 in bin
+ * 65, 2048-2559 in bin 68). Everything too large for the last bin goes in it as well.
+ *
+ * @param size: The block size.
+ * @return The bin index.
+ */
+static int hist_index(size_t size){
+    if (size < KILO){
+        return size / SMALL_BIN_WIDTH;
+    }
+    int log = 63 - __builtin_clzll(size);
+    int index = SMALL_BINS + (log - 10) * Policy::large_bin_split
+                + (int) ((size >> (log - Policy::large_bin_split_log)) & (Policy::large_bin_split - 1));
+    return index < HIST_SIZE ? index : HIST_SIZE - 1;
+}
+
+/***
+ * Finds the first non empty bin starting from a given index, using the bitmap.
+ *
+ * @param index: The first bin to consider.
+ * @return The bin index or -1 if all the bins from index onwards are empty.
+ */
+static int hist_first_set(Arena* arena, int index){
+    for (int word = index / 64; word < HIST_SIZE / 64; word++){
+        uint64_t bits = arena->hist_bitmap[word];
+        if (word == index / 64){
+            bits &= ~0ULL << (index % 64);
+        }
+        if (bits){
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+/***
+ * Insert an entry into the histogram.
+ *
+ * Pushes the entry to the head of the bin that hist_index() picks for its size. Bins are not sorted.
+ *
+ * @param entry: The entry.
+ */
+static void hist_insert( Arena* arena, MallocMetadata* entry ){
+    assert(isFree(entry));
+    int index = hist_index(blockSize(entry));
+    FreeLinks* links = freeLinks(entry);
+    links->prev2 = nullptr;
+    links->next2 = arena->hist[index];
+    if (arena->hist[index]){
+        freeLinks(arena->hist[index])->prev2 = entry;
+    }
+    arena->hist[index] = entry;
+    arena->hist_bitmap[index / 64] |= 1ULL << (index % 64);
+    arena->stats.free_blocks++;
+    arena->stats.free_bytes += blockSize(entry);
+    arena->bin_blocks[index]++;
+    arena->bin_bytes[index] += blockSize(entry);
+}
+
+/***
+ * Removes an entry from the histogram. This function assumes that the argument
+ * provided is a valid address to a metadata struct and that it is already in the hist.
+ *
+ * @param entry: the entry.
+ */
+static void hist_remove( Arena* arena, MallocMetadata* entry ){
+    if (!isFree(entry)){
+        return;
+    }
+    int index = hist_index(blockSize(entry));
+    FreeLinks* links = freeLinks(entry);
+    if (Policy::fit::roving && arena->rover == entry){
+        arena->rover = links->next2;
+    }
+    if ( !(links->prev2) ) {
+        arena->hist[index] = links->next2;
+        if ( !arena->hist[index] ) {
+            arena->hist_bitmap[index / 64] &= ~(1ULL << (index % 64));
+        }
+    }
+    else{
+        freeLinks(links->prev2)->next2 = links->next2;
+    }
+    if ( links->next2 ) {
+        freeLinks(links->next2)->prev2 = links->prev2;
+    }
+    arena->stats.free_blocks--;
+    arena->stats.free_bytes -= blockSize(entry);
+    arena->bin_blocks[index]--;
+    arena->bin_bytes[index] -= blockSize(entry);
+}
+
+/***
+ * Finds and removes a block of the given size with the fit of the Policy. This function does not change
+ * the metadata that it returns to mark it as not free, it should be done outside the function.
+ *
+ * @param size
+ * @return A metadata block of at least size or NULL if no block was found.
+ */
+static MallocMetadata* hist_search(Arena* arena, size_t size) {
+    return Policy::fit::search(arena, size);
+}
+
+/***
+ * Only the bin of the size itself can hold blocks that are too small, so it is the only one that
+ * is scanned, and only its first HIST_SCAN_LIMIT blocks. Any block in a higher non empty bin is
+ * large enough, and the bitmap finds the first such bin in constant time.
+ */
+inline MallocMetadata* FirstFit::search(Arena* arena, size_t size) {
+    int index = hist_index(size);
+    int scanned = 0;
+    for (MallocMetadata* it = arena->hist[index]; it && scanned < HIST_SCAN_LIMIT; it = freeLinks(it)->next2, scanned++){
+        if (blockSize(it) >= size){
+            hist_remove(arena, it);
+            return it;
+        }
+    }
+
+    if (index + 1 == HIST_SIZE){
+        return nullptr;
+    }
+    index = hist_first_set(arena, index + 1);
+    if (index < 0){
+        return nullptr;
+    }
+    MallocMetadata* block = arena->hist[index];
+    hist_remove(arena, block);
+    return block;
+}
+
+/***
+ * The scan of a bin starts at the rover if it is in that bin and wraps around to the head, and the
+ * block after the one taken becomes the rover, so the blocks at the head of a bin are not split over
+ * and over while the ones behind them wait.
+ */
+inline MallocMetadata* NextFit::search(Arena* arena, size_t size) {
+    int index = hist_index(size);
+    MallocMetadata* rover = arena->rover;
+    MallocMetadata* start = (rover && hist_index(blockSize(rover)) == index) ? rover : arena->hist[index];
+    MallocMetadata* it = start;
+    for (int scanned = 0; it && scanned < HIST_SCAN_LIMIT; scanned++){
+        if (blockSize(it) >= size){
+            break;
+        }
+        it = freeLinks(it)->next2 ? freeLinks(it)->next2 : arena->hist[index];
+        if (it == start){
+            it = nullptr;
+        }
+    }
+    if (it && blockSize(it) < size){
+        it = nullptr;
+    }
+
+    if (!it && index + 1 < HIST_SIZE){
+        index = hist_first_set(arena, index + 1);
+        if (index >= 0){
+            it = (rover && hist_index(blockSize(rover)) == index) ? rover : arena->hist[index];
+        }
+    }
+    if (!it){
+        return nullptr;
+    }
+    MallocMetadata* next = freeLinks(it)->next2;
+    hist_remove(arena, it);
+    arena->rover = next;
+    return it;
+}
+
+/***
+ * Scans the whole bin of the size, and if no block there fits the whole first non empty bin above it,
+ * for the fitting block with the smallest size, or with the lowest address.
+ */
+static MallocMetadata* scanSearch(Arena* arena, size_t size, bool by_address) {
+    int index = hist_index(size);
+    MallocMetadata* pick = nullptr;
+    for (int round = 0; round < 2 && !pick; round++){
+        if (round == 1){
+            index = index + 1 < HIST_SIZE ? hist_first_set(arena, index + 1) : -1;
+            if (index < 0){
+                return nullptr;
+            }
+        }
+        for (MallocMetadata* it = arena->hist[index]; it; it = freeLinks(it)->next2){
+            if (blockSize(it) < size){
+                continue;
+            }
+            if (!pick || (by_address ? it < pick : blockSize(it) < blockSize(pick))){
+                pick = it;
+                if (!by_address && blockSize(pick) == size){
+                    break;
+                }
+            }
+        }
+    }
+    if (pick){
+        hist_remove(arena, pick);
+    }
+    return pick;
+}
+
+inline MallocMetadata* BestFit::search(Arena* arena, size_t size) {
+    return scanSearch(arena, size, false);
+}
+
+inline MallocMetadata* AddressOrderedFit::search(Arena* arena, size_t size) {
+    return scanSearch(arena, size, true);
+}
+
+/************* CHALLENGE 1 *************/
+/***
+ * Splits a block that is not in the histogram (or about to be allocated) into a block of the given
+ * size and a free remainder, which is merged with the block after it if that one is free too. The
+ * remainder of a known zero block is known zero as well.
+ */
+static bool mergeNextBlock(Arena* arena, MallocMetadata* block);
+
+static void splitBlock(Arena* arena, MallocMetadata* block, size_t size) {
+    assert(block);
+
+    MallocMetadata* split = (MallocMetadata*) ( ( (char*)  block + size_of_metadata + size) );
+    split->size = (blockSize(block) - size - size_of_metadata) | (block->size & ZERO_BIT);
+    setSize(block, size);
+    if (arena->list_tail == block) {
+        arena->list_tail = split;
+    }
+    arena->stats.blocks++;
+    arena->stats.bytes -= size_of_metadata;
+
+    mergeNextBlock(arena, split);
+    markFree(arena, split);
+    hist_insert(arena, split);
+}
+
+/************* CHALLENGE 2 *************/
+/***
+ * Absorbs the next block into the given one if it is free. The next block is taken out of the
+ * histogram; the caller is responsible for marking the result free or used. The result stays known
+ * zero only if both blocks were, once the header and links that end up inside it are cleared.
+ */
+static bool mergeNextBlock(Arena* arena, MallocMetadata* block) {
+    assert(block);
+    MallocMetadata* next = nextBlock(arena, block);
+    if (next == nullptr){
+        return false;
+    }
+    if (!isFree(next)){
+        return false;
+    }
+    hist_remove(arena, next);
+    if (isZero(block) && isZero(next)){
+        std::memset(next, 0, size_of_metadata + MIN_PAYLOAD);
+    } else {
+        block->size &= ~(size_t) ZERO_BIT;
+    }
+    setSize(block, blockSize(block) + size_of_metadata + blockSize(next));
+    if (arena->list_tail == next){
+        arena->list_tail = block;
+    }
+    arena->stats.blocks--;
+    arena->stats.bytes += size_of_metadata;
+    return true;
+}
+
+/***
+ * Lets the previous block absorb the given one if it is free. The previous block is taken out of
+ * the histogram; the caller is responsible for marking the result free or used.
+ *
+ * @return The merged block, or the given block if the previous one is not free.
+ */
+static MallocMetadata* mergePrevBlock(Arena* arena, MallocMetadata* block) {
+    MallocMetadata* prev = prevFreeBlock(block);
+    if (prev == nullptr){
+        return block;
+    }
+    hist_remove(arena, prev);
+    if (isZero(prev) && isZero(block)){
+        std::memset(block, 0, size_of_metadata + MIN_PAYLOAD);
+    } else {
+        prev->size &= ~(size_t) ZERO_BIT;
+    }
+    setSize(prev, blockSize(prev) + size_of_metadata + blockSize(block));
+    if (arena->list_tail == block){
+        arena->list_tail = prev;
+    }
+    arena->stats.blocks--;
+    arena->stats.bytes += size_of_metadata;
+    return prev;
+}
+
+/************* MMAP CACHE *************/
+/* Large blocks are not unmapped right away. Their regions are kept in a cache, in buckets by length
+ * (the hist_index() bins), and mmapAlloc reuses one that is at most 25% longer than it needs, which
+ * saves the mmap, the munmap and the page faults. The cache holds at most mmap_cache_max bytes; past
+ * that the regions that were cached the longest ago are unmapped first. A cached region starts with a
+ * CachedRegion. Everything here is protected by mmap_lock. */
+struct CachedRegion {
+    CachedRegion* next;     // same bucket
+    CachedRegion* prev;
+    CachedRegion* newer;    // all the buckets, in the order they were cached
+    CachedRegion* older;
+    size_t length;
+};
+
+static size_t mmap_cache_max = 32 * KILO * KILO;
+static size_t mmap_cache_bytes = 0;
+static size_t mmap_cache_hits = 0;
+static size_t mmap_cache_misses = 0;
+static CachedRegion* mmap_cache[HIST_SIZE] = {};
+static CachedRegion* mmap_cache_oldest = nullptr;
+static CachedRegion* mmap_cache_newest = nullptr;
+
+static void mmapCacheRemove(CachedRegion* region){
+    int index = hist_index(region->length);
+    if (region->prev){
+        region->prev->next = region->next;
+    } else {
+        mmap_cache[index] = region->next;
+    }
+    if (region->next){
+        region->next->prev = region->prev;
+    }
+    if (region->newer){
+        region->newer->older = region->older;
+    } else {
+        mmap_cache_newest = region->older;
+    }
+    if (region->older){
+        region->older->newer = region->newer;
+    } else {
+        mmap_cache_oldest = region->newer;
+    }
+    mmap_cache_bytes -= region->length;
+}
+
+/***
+ * Takes the oldest regions out of the cache until it holds at most keep bytes.
+ *
+ * @return The regions taken out, linked through next, for the caller to unmap once it released
+ * mmap_lock.
+ */
+static CachedRegion* mmapCacheEvict(size_t keep){
+    CachedRegion* evicted = nullptr;
+    while (mmap_cache_bytes > keep){
+        CachedRegion* region = mmap_cache_oldest;
+        mmapCacheRemove(region);
+        region->next = evicted;
+        evicted = region;
+    }
+    return evicted;
+}
+
+static void mmapCacheUnmap(CachedRegion* evicted){
+    while (evicted){
+        CachedRegion* next = evicted->next;
+        munmap(evicted, evicted->length);
+        evicted = next;
+    }
+}
+
+/***
+ * Finds a cached region of at least length bytes and at most a quarter more, in the bucket of length
+ * and the one after it.
+ *
+ * @return The region, taken out of the cache, or NULL.
+ */
+static CachedRegion* mmapCacheTake(size_t length){
+    int index = hist_index(length);
+    for (int bucket = index; bucket < HIST_SIZE && bucket <= index + 1; bucket++){
+        for (CachedRegion* it = mmap_cache[bucket]; it; it = it->next){
+            if (it->length >= length && it->length <= length + length / 4){
+                mmapCacheRemove(it);
+                mmap_cache_hits++;
+                return it;
+            }
+        }
+    }
+    mmap_cache_misses++;
+    return nullptr;
+}
+
+/***
+ * Puts a region in the cache, evicting older ones if needed.
+ *
+ * @return The regions to unmap (see mmapCacheEvict), the given one if it does not fit at all.
+ */
+static CachedRegion* mmapCachePut(void* start, size_t length){
+    CachedRegion* region = (CachedRegion*) start;
+    region->length = length;
+    if (length > mmap_cache_max){
+        region->next = nullptr;
+        return region;
+    }
+    CachedRegion* evicted = mmapCacheEvict(mmap_cache_max - length);
+    int index = hist_index(length);
+    region->prev = nullptr;
+    region->next = mmap_cache[index];
+    if (region->next){
+        region->next->prev = region;
+    }
+    mmap_cache[index] = region;
+    region->newer = nullptr;
+    region->older = mmap_cache_newest;
+    if (mmap_cache_newest){
+        mmap_cache_newest->newer = region;
+    } else {
+        mmap_cache_oldest = region;
+    }
+    mmap_cache_newest = region;
+    mmap_cache_bytes += length;
+    return evicted;
+}
+
+/***
+ * Links a block into the mmap list, which is unordered. The caller must hold mmap_lock.
+ */
+static void mmapListPush(MallocMetadata* block){
+    mmapLinks(block)->next = mmap_list_head;
+    mmapLinks(block)->prev = nullptr;
+    if (mmap_list_head){
+        mmapLinks(mmap_list_head)->prev = block;
+    }
+    mmap_list_head = block;
+    mmap_blocks++;
+    mmap_bytes += blockSize(block);
+}
+
+/***
+ * Unlinks a block from the mmap list. The caller must hold mmap_lock.
+ */
+static void mmapListRemove(MallocMetadata* block){
+    MallocMetadata* next_meta = mmapLinks(block)->next;
+    MallocMetadata* prev_meta = mmapLinks(block)->prev;
+    if(block == mmap_list_head){
+        mmap_list_head = next_meta;
+    }
+    if(next_meta != nullptr){
+        mmapLinks(next_meta)->prev = prev_meta;
+    }
+    if(prev_meta != nullptr){
+        mmapLinks(prev_meta)->next = next_meta;
+    }
+    mmap_blocks--;
+    mmap_bytes -= blockSize(block);
+}
+
+/***
+ * @return The length of the region of an mmap'ed block.
+ */
+static size_t regionLength(MallocMetadata* block){
+    return block->prev_size & ~(size_t) REGION_HUGETLB;
+}
+
+/***
+ * @return The start of the region of an mmap'ed block. The MmapLinks are at its start, except for
+ * blocks of smemalign, whose links are pushed into the first page to align the payload.
+ */
+static char* regionOf(MallocMetadata* block){
+    return pageDown((char*) mmapLinks(block));
+}
+
+/***
+ * Maps a region for a huge page backed block: with MAP_HUGETLB in mode 2 if the system has huge pages
+ * reserved, otherwise a region aligned to HUGE_PAGE_SIZE (mapped larger, then trimmed) advised with
+ * MADV_HUGEPAGE.
+ *
+ * @param length: The length needed, rounded up to a whole number of huge pages.
+ * @param hugetlb: Set if the region was mapped with MAP_HUGETLB.
+ * @return The region or (void*) -1.
+ */
+static void* hugeMap(size_t* length, bool* hugetlb){
+    *length = (*length + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+    *hugetlb = false;
+    if (hugepage_mode == 2){
+        void* region = mmap(nullptr, *length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (region != (void*) -1){
+            *hugetlb = true;
+            return region;
+        }
+    }
+    char* region = (char*) mmap(nullptr, *length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (region == (void*) -1){
+        return region;
+    }
+    char* aligned = (char*) (((uintptr_t) region + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned != region){
+        munmap(region, aligned - region);
+    }
+    munmap(aligned + *length, region + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, *length, MADV_HUGEPAGE);
+    return aligned;
+}
+
+/***
+ * Maps a block of its own for a large allocation, or reuses a cached region, and links it into the
+ * mmap list. The header's prev_size holds the length of the region, which may be more than the block
+ * needs, and REGION_HUGETLB. In huge page mode blocks of a huge page and more get a region of their own
+ * from hugeMap instead.
+ *
+ * @param dirty: If not NULL, set to 0 when the block is a fresh mapping, whose payload reads as zeros.
+ */
+static void* mmapAlloc(size_t size, size_t* dirty){
+    size = alignSize(size);
+    size_t length = (size + MMAP_HEADER_SIZE + OS_PAGE_SIZE - 1) & ~(size_t) (OS_PAGE_SIZE - 1);
+    void* mmap_addr = nullptr;
+    bool hugetlb = false;
+    bool cached = false;
+    if (hugepage_mode && size >= HUGE_PAGE_SIZE){
+        mmap_addr = hugeMap(&length, &hugetlb);
+        if (mmap_addr == (void*) -1){
+            return nullptr;
+        }
+    } else {
+        LockGuard guard(&mmap_lock);
+        CachedRegion* region = mmapCacheTake(length);
+        if (region){
+            length = region->length;
+            cached = true;
+        }
+        mmap_addr = region;
+    }
+    if (!mmap_addr){
+        mmap_addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if(mmap_addr == (void*)(-1)){
+            return nullptr;
+        }
+    }
+    if (dirty && !cached){
+        *dirty = 0;
+    }
+    MallocMetadata* new_block = (MallocMetadata*) ((char*) mmap_addr + sizeof(MmapLinks));
+    new_block->prev_size = length | (hugetlb ? REGION_HUGETLB : 0);
+    new_block->size = size | MMAP_BIT;
+
+    LockGuard guard(&mmap_lock);
+    mmapListPush(new_block);
+    return payloadOf(new_block);
+}
+
+/***
+ * Maps a block of its own whose payload is aligned to more than 16 bytes. The region is mapped large
+ * enough to slide the payload up to the alignment, then the pages before the one holding the links
+ * and the pages after the block are unmapped. Aligned blocks do not come from the cache.
+ *
+ * @param alignment: A power of two larger than 16.
+ */
+static void* mmapAlignedAlloc(size_t alignment, size_t size){
+    size = alignSize(size);
+    size_t mapped = (size + MMAP_HEADER_SIZE + alignment + OS_PAGE_SIZE - 1) & ~(size_t) (OS_PAGE_SIZE - 1);
+    char* mmap_addr = (char*) mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mmap_addr == (char*) -1){
+        return nullptr;
+    }
+    char* payload = (char*) (((uintptr_t) mmap_addr + MMAP_HEADER_SIZE + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    char* region = pageDown(payload - MMAP_HEADER_SIZE);
+    char* end = pageUp(payload + size);
+    if (region != mmap_addr){
+        munmap(mmap_addr, region - mmap_addr);
+    }
+    if (end != mmap_addr + mapped){
+        munmap(end, mmap_addr + mapped - end);
+    }
+    MallocMetadata* new_block = headerOf(payload);
+    new_block->prev_size = end - region;
+    new_block->size = size | MMAP_BIT;
+
+    LockGuard guard(&mmap_lock);
+    mmapListPush(new_block);
+    return payload;
+}
+
+/***
+ * Unlinks a block from the mmap list and puts its region in the cache.
+ */
+static void mmapFree(MallocMetadata* metadata){
+    CachedRegion* evicted;
+    {
+        LockGuard guard(&mmap_lock);
+        mmapListRemove(metadata);
+        if (metadata->prev_size & REGION_HUGETLB){
+            /******** Huge pages are reserved memory, give them back right away ********/
+            evicted = (CachedRegion*) regionOf(metadata);
+            evicted->length = regionLength(metadata);
+            evicted->next = nullptr;
+        } else {
+            evicted = mmapCachePut(regionOf(metadata), metadata->prev_size);
+        }
+    }
+    mmapCacheUnmap(evicted);
+}
+
+/***
+ * Resizes a large block without copying it: it shrinks by unmapping the pages past the new size and
+ * grows with mremap, which moves the pages instead of the data if the region cannot grow where it is.
+ * A block of smemalign that moves keeps its alignment up to the page size only, like with realloc.
+ *
+ * @return The block's payload, which may have moved, or NULL if mremap failed.
+ */
+static void* mmapRealloc(MallocMetadata* metadata, size_t size){
+    if (metadata->prev_size & REGION_HUGETLB){
+        return nullptr; // huge pages can only be remapped in whole huge pages, let the caller copy
+    }
+    size = alignSize(size);
+    char* region = regionOf(metadata);
+    size_t offset = (char*) mmapLinks(metadata) - region;
+    size_t length = (offset + size + MMAP_HEADER_SIZE + OS_PAGE_SIZE - 1) & ~(size_t) (OS_PAGE_SIZE - 1);
+    size_t old_length = metadata->prev_size;
+    if (length <= old_length){
+        if (length < old_length){
+            munmap(region + length, old_length - length);
+            metadata->prev_size = length;
+        }
+        LockGuard guard(&mmap_lock);
+        mmap_bytes += size - blockSize(metadata);
+        setSize(metadata, size);
+        return payloadOf(metadata);
+    }
+
+    /******** The block leaves the list while it may move, so no one follows a stale link ********/
+    {
+        LockGuard guard(&mmap_lock);
+        mmapListRemove(metadata);
+    }
+    void* moved = mremap(region, old_length, length, MREMAP_MAYMOVE);
+    if (moved != MAP_FAILED){
+        metadata = (MallocMetadata*) ((char*) moved + offset + sizeof(MmapLinks));
+        metadata->prev_size = length;
+        setSize(metadata, size);
+    }
+    LockGuard guard(&mmap_lock);
+    mmapListPush(metadata);
+    return moved != MAP_FAILED ? payloadOf(metadata) : nullptr;
+}
+
+/************* TRIMMING *************/
+/***
+ * Gives the pages of a free block that is in the histogram back to the OS. A wilderness of at least
+ * trim_threshold bytes more than a growth step (heap_growth) is cut down to a step past the first page
+ * boundary after its links, which lowers the top of the heap, and the step it keeps is dropped with
+ * MADV_DONTNEED. An interior block of at least madvise_threshold bytes keeps its header and links,
+ * and the whole pages after them are dropped with MADV_DONTNEED; they read as zeros the next time
+ * they are touched. The caller must hold the arena's lock.
+ *
+ * Free blocks of madvise_threshold bytes and more have been dropped already, so only the part of the
+ * block between dirty_start and dirty_end, which was used or in a smaller free block until now, is
+ * passed to madvise. Without that, every free next to a large free block would drop it again.
+ *
+ * A trimmed wilderness, and a dropped block whose rest is known zero (clean), have the partial pages
+ * around what was dropped cleared and become known zero, so scalloc can skip them.
+ */
+static void heapTrim(Arena* arena, MallocMetadata* block, char* dirty_start, char* dirty_end, bool clean){
+    size_t size = blockSize(block);
+    char* links_end = (char*) payloadOf(block) + MIN_PAYLOAD;
+    if (!nextBlock(arena, block)){
+        /******** A growth step is kept, so a heap that is trimmed does not grow right back ********/
+        if (!trim_threshold || size < trim_threshold + heap_growth){
+            return;
+        }
+        char* page = pageUp(links_end);
+        char* keep = pageUp(links_end + heap_growth);
+        if (keep >= arena->top){
+            return;
+        }
+        size_t diff = arena->top - keep;
+        if (arenaGrow(arena, -(intptr_t) diff) == (void*) -1){
+            return;
+        }
+        hist_remove(arena, block);
+        setSize(block, size - diff);
+        hist_insert(arena, block);
+        arena->stats.bytes -= diff;
+        arena->stats.trimmed_bytes += diff;
+        arena->grow_step = 0;
+        if (arena->used_end > page){
+            arena->used_end = page;
+        }
+        std::memset(links_end, 0, page - links_end);
+        if (page == arena->top || madvise(page, arena->top - page, MADV_DONTNEED) == 0){
+            arena->stats.madvised_bytes += arena->top - page;
+            block->size |= ZERO_BIT;
+        }
+        return;
+    }
+    if (!madvise_threshold || size < madvise_threshold){
+        return;
+    }
+    char* first = links_end > dirty_start ? links_end : dirty_start;
+    char* start = pageUp(first);
+    char* end = pageDown(dirty_end);
+    if (start < end && madvise(start, end - start, MADV_DONTNEED) == 0){
+        arena->stats.madvised_bytes += end - start;
+        if (clean){
+            std::memset(first, 0, start - first);
+            std::memset(end, 0, dirty_end - end);
+            block->size |= ZERO_BIT;
+        }
+    }
+}
+
+/************* FAST BINS *************/
+/* With M_FASTBIN_MAX set, freed blocks up to that size skip coalescing: they stay marked used, so no
+ * neighbour merges with them, and go on a LIFO list per exact size that the next request of that size
+ * pops. They are coalesced in one pass when a request finds no fitting free block, or when the fast bins
+ * of the arena hold FASTBIN_CONSOLIDATE bytes and a larger block is freed. Like the thread cache,
+ * blocks in the fast bins count as allocated in the statistics. */
+
+/***
+ * Merges a used block with its free neighbours and puts the result in the histogram, then trims it.
+ * The caller must hold the arena's lock.
+ */
+static void heapCoalesce(Arena* arena, MallocMetadata* metadata){
+    char* dirty_start = (char*) metadata;
+    char* dirty_end = (char*) payloadOf(metadata) + blockSize(metadata);
+    bool clean = true; // the neighbours left out of the dirty range read as zeros
+    MallocMetadata* prev = prevFreeBlock(metadata);
+    if (prev && blockSize(prev) < madvise_threshold){
+        dirty_start = (char*) prev;
+    } else if (prev){
+        clean = isZero(prev);
+    }
+    MallocMetadata* next = nextBlock(arena, metadata);
+    if (next && isFree(next)){
+        if (blockSize(next) < madvise_threshold){
+            dirty_end = (char*) payloadOf(next) + blockSize(next);
+        } else {
+            /******** Its header and links end up inside the merged block ********/
+            dirty_end = (char*) payloadOf(next) + MIN_PAYLOAD;
+            clean = clean && isZero(next);
+        }
+    }
+
+    mergeNextBlock(arena, metadata);
+    metadata = mergePrevBlock(arena, metadata);
+    markFree(arena, metadata);
+    hist_insert(arena, metadata);
+    heapTrim(arena, metadata, dirty_start, dirty_end, clean);
+}
+
+/***
+ * Coalesces every block of the arena's fast bins. The caller must hold the arena's lock.
+ */
+static void fastbinConsolidate(Arena* arena){
+    for (int i = 0; i < FASTBIN_CLASSES; i++){
+        MallocMetadata* block = arena->fastbins[i];
+        arena->fastbins[i] = nullptr;
+        while (block){
+            MallocMetadata* next = freeLinks(block)->next2;
+            heapCoalesce(arena, block);
+            block = next;
+        }
+    }
+    arena->fast_bytes = 0;
+}
+
+/***
+ * Splits what a block that ends at the top of the heap does not need off as the wilderness. Memory
+ * past the top of a heap reads as zeros: it was never used, or was decommitted when the heap shrank,
+ * so when the heap just grew the wilderness is known zero.
+ */
+static void splitGrown(Arena* arena, MallocMetadata* block, size_t size, bool grew){
+    if (blockSize(block) - size < size_of_metadata + Policy::split_min){
+        return;
+    }
+    splitBlock(arena, block, size);
+    if (grew){
+        nextBlock(arena, block)->size |= ZERO_BIT;
+    }
+}
+
+/***
+ * The body of smalloc. Large sizes are mmap'ed, the rest comes from the arena, whose lock the
+ * caller must hold. The caller must have validated the size.
+ *
+ * @param dirty: If not NULL, lowered to the length of the payload's prefix that may not read as
+ * zeros when less of it than that can, which is how scalloc skips memory that is known zero.
+ */
+static void* heapAlloc(Arena* arena, size_t size, size_t* dirty){
+    if (size >= Policy::mmap_threshold) {
+        return mmapAlloc(size, dirty);
+    }
+    size = alignSize(size);
+    if (size <= fastbin_max){
+        MallocMetadata** bin = &arena->fastbins[size / SMALL_BIN_WIDTH];
+        if (*bin){
+            MallocMetadata* block = *bin;
+            *bin = freeLinks(block)->next2;
+            arena->fast_bytes -= size;
+            return payloadOf(block);
+        }
+    }
+    MallocMetadata* free_block = hist_search(arena, size);
+    if (!free_block && arena->fast_bytes){
+        fastbinConsolidate(arena);
+        free_block = hist_search(arena, size);
+    }
+    if ( !free_block ) {
+        /******** No free large enough block was found ********/
+
+        /******** Wilderness block *************/
+        MallocMetadata* last_block = listGetTail(arena);
+        size_t grown;
+        if ( last_block && isFree(last_block) ) {
+            /* the bin scan is capped, so the wilderness may already be large enough */
+            size_t diff = size > blockSize(last_block) ? size - blockSize(last_block) : 0;
+            void* addr = heapGrow(arena, diff, &grown);
+            if (addr == (void*) -1){
+                return nullptr;
+            }
+            hist_remove(arena, last_block);
+            if (dirty){
+                /******** What the heap grew by reads as zeros ********/
+                *dirty = std::min(*dirty, isZero(last_block) ? (size_t) MIN_PAYLOAD : blockSize(last_block));
+            }
+            setSize(last_block, blockSize(last_block) + grown);
+            arena->stats.bytes += grown;
+            splitGrown(arena, last_block, size, grown);
+            markUsed(arena, last_block);
+            heapUsed(arena, (char*) payloadOf(last_block) + size, grown);
+            return payloadOf(last_block);
+        }
+
+        void* block_start = heapGrow(arena, size + size_of_metadata, &grown);
+        if ( block_start == (void*) -1 ){
+            return nullptr;
+        }
+        MallocMetadata* metadata = (MallocMetadata*) block_start;
+        metadata->prev_size = 0;
+        metadata->size = grown - size_of_metadata;
+        listInsertToTail(arena, metadata);
+        arena->stats.blocks++;
+        arena->stats.bytes += grown - size_of_metadata;
+        splitGrown(arena, metadata, size, true);
+        if (dirty){
+            *dirty = 0;
+        }
+        heapUsed(arena, (char*) payloadOf(metadata) + size, true);
+        return payloadOf(metadata);
+    }
+
+    /***** A free block large enough was found *****/
+
+    if ( (blockSize(free_block) - size) >= (size_of_metadata + Policy::split_min) ){
+        /******** Need to split the block ***********/
+        splitBlock(arena, free_block, size);
+    }
+    if (dirty && isZero(free_block)){
+        *dirty = std::min(*dirty, (size_t) MIN_PAYLOAD);
+    }
+    markUsed(arena, free_block);
+    heapUsed(arena, (char*) payloadOf(free_block) + size, false);
+    return payloadOf(free_block);
+}
+
+/***
+ * The body of sfree for blocks of the arena's heap. Blocks small enough for the fast bins are only
+ * pushed there; the others are coalesced right away, and consolidate the fast bins once they hold
+ * FASTBIN_CONSOLIDATE bytes. The caller must hold the arena's lock.
+ */
+static void heapFree(Arena* arena, void* p){
+    MallocMetadata *metadata = headerOf(p);
+    if (isFree(metadata)){
+        return;
+    }
+    size_t size = blockSize(metadata);
+    if (size <= fastbin_max){
+        MallocMetadata** bin = &arena->fastbins[size / SMALL_BIN_WIDTH];
+        if (*bin != metadata){ // a double free of the last block freed would make a loop
+            freeLinks(metadata)->next2 = *bin;
+            *bin = metadata;
+            arena->fast_bytes += size;
+        }
+        return;
+    }
+    heapCoalesce(arena, metadata);
+    if (arena->fast_bytes >= FASTBIN_CONSOLIDATE){
+        fastbinConsolidate(arena);
+    }
+}
+
+/***
+ * The body of srealloc for a block of the arena's heap. It grows in place when it can, first into a
+ * free next block, then into the wilderness, and only then moves: down into a free previous block, or
+ * to a new block. Either way only the old payload is copied. A shrink splits the tail off and gives it
+ * back to the histogram, or to the OS if it is large enough. The caller must hold the arena's lock and
+ * have validated the size.
+ */
+static void* heapRealloc(Arena* arena, void* oldp, size_t size){
+    size = alignSize(size);
+    MallocMetadata* metadata = headerOf(oldp);
+    size_t old_size = blockSize(metadata);
+    MallocMetadata* next = nextBlock(arena, metadata);
+    MallocMetadata* prev = prevFreeBlock(metadata);
+    size_t next_size = (next && isFree(next)) ? blockSize(next) + size_of_metadata : 0;
+    size_t prev_size = prev ? blockSize(prev) + size_of_metadata : 0;
+    bool grew = false;
+
+    if (size <= old_size){
+        /******** Shrinks in place, the tail is split off below ********/
+    }
+    else if (next_size && next_size + old_size >= size){ // Can combine the next
+        mergeNextBlock(arena, metadata);
+        markUsed(arena, metadata);
+    }
+    else if (!next || (next_size && !nextBlock(arena, next))){ // The block or the free next one is the wilderness
+        size_t grown;
+        void* addr = heapGrow(arena, size - old_size - next_size, &grown);
+        if (addr == (void*) -1) {
+            return nullptr;
+        }
+        mergeNextBlock(arena, metadata);
+        setSize(metadata, blockSize(metadata) + grown);
+        markUsed(arena, metadata);
+        arena->stats.bytes += grown;
+        grew = true;
+    }
+    else if (prev && prev_size + old_size + next_size >= size){ // Can combine the prev, and the next if free
+        mergeNextBlock(arena, metadata);
+        metadata = mergePrevBlock(arena, metadata);
+        markUsed(arena, metadata);
+        std::memmove(payloadOf(metadata), oldp, old_size);
+    } else{ // Need to allocate
+        void* addr = heapAlloc(arena, size, nullptr);
+        if (!addr){
+            return nullptr;
+        }
+        std::memcpy(addr, oldp, old_size);
+        heapFree(arena, oldp);
+        return addr;
+    }
+
+    if (blockSize(metadata) >= size + size_of_metadata + Policy::split_min){
+        splitBlock(arena, metadata, size);
+        if (size < old_size){
+            /******** Only the part the block gave up was in use, the rest was free already ********/
+            MallocMetadata* rest = nextBlock(arena, metadata);
+            heapTrim(arena, rest, (char*) rest, (char*) oldp + old_size, false);
+        }
+    }
+    if (size > old_size){
+        heapUsed(arena, (char*) payloadOf(metadata) + size, grew);
+    }
+
+    return payloadOf(metadata);
+}
+
+
+/***
+ * The body of smemalign for blocks of the arena's heap. It allocates enough to slide the payload up to
+ * the alignment, then splits the slack before the aligned header off as a free block, and the slack
+ * after the block too if it is large enough. The caller must hold the arena's lock.
+ *
+ * @param alignment: A power of two larger than 16.
+ */
+static void* heapAlignedAlloc(Arena* arena, size_t alignment, size_t size){
+    size = alignSize(size);
+    /******* The leading slack is either none or a whole free block ******/
+    char* p = (char*) heapAlloc(arena, size + alignment + size_of_metadata + MIN_PAYLOAD, nullptr);
+    if (!p){
+        return nullptr;
+    }
+    MallocMetadata* block = headerOf(p);
+    if ((uintptr_t) p & (alignment - 1)){
+        char* aligned = (char*) (((uintptr_t) p + size_of_metadata + MIN_PAYLOAD + alignment - 1) & ~(uintptr_t) (alignment - 1));
+        size_t lead = aligned - p;
+        MallocMetadata* aligned_block = headerOf(aligned);
+        aligned_block->size = blockSize(block) - lead;
+        setSize(block, lead - size_of_metadata);
+        if (arena->list_tail == block){
+            arena->list_tail = aligned_block;
+        }
+        arena->stats.blocks++;
+        arena->stats.bytes -= size_of_metadata;
+        /******* A block from a fast bin may follow a free block ******/
+        MallocMetadata* lead_block = mergePrevBlock(arena, block);
+        markFree(arena, lead_block);
+        hist_insert(arena, lead_block);
+        block = aligned_block;
+    }
+    if (blockSize(block) - size >= size_of_metadata + Policy::split_min){
+        splitBlock(arena, block, size);
+    }
+    return payloadOf(block);
+}
+
+/***
+ * The body of smalloc_batch for blocks of the arena's heap: carves blocks of the same size out of a
+ * single block, found or grown with one heapAlloc, so the bins and the top of the heap are touched
+ * once for the whole batch. The last block keeps the slack. The block stays under the mmap threshold,
+ * so a batch may get fewer blocks than asked for. The aligned size must be below the threshold. The
+ * caller must hold the arena's lock.
+ *
+ * @return How many blocks were stored in out, 0 if the heap is full.
+ */
+static size_t heapAllocBatch(Arena* arena, size_t size, size_t count, void** out){
+    size = alignSize(size);
+    size_t stride = size + size_of_metadata;
+    size_t max_count = (Policy::mmap_threshold - 1 + size_of_metadata) / stride;
+    if (count > max_count){
+        count = max_count;
+    }
+    char* p = (char*) heapAlloc(arena, count * stride - size_of_metadata, nullptr);
+    if (!p){
+        return 0;
+    }
+    MallocMetadata* block = headerOf(p);
+    MallocMetadata* last = (MallocMetadata*) ((char*) block + (count - 1) * stride);
+    if (last != block){
+        last->size = blockSize(block) - (count - 1) * stride;
+        setSize(block, size);
+        for (size_t i = 1; i < count - 1; i++){
+            ((MallocMetadata*) ((char*) block + i * stride))->size = size;
+        }
+        if (arena->list_tail == block){
+            arena->list_tail = last;
+        }
+        arena->stats.blocks += count - 1;
+        arena->stats.bytes -= (count - 1) * size_of_metadata;
+    }
+    for (size_t i = 0; i < count; i++){
+        out[i] = p + i * stride;
+    }
+    return count;
+}
+
+/***
+ * Frees used blocks that lie back to back in the arena's heap, from first to last, by merging them
+ * into one block first, so the free path runs once for the whole run. The caller must hold the
+ * arena's lock.
+ */
+static void heapFreeRun(Arena* arena, MallocMetadata* first, MallocMetadata* last, size_t blocks){
+    char* end = (char*) payloadOf(last) + blockSize(last);
+    setSize(first, end - (char*) payloadOf(first));
+    if (arena->list_tail == last){
+        arena->list_tail = first;
+    }
+    arena->stats.blocks -= blocks - 1;
+    arena->stats.bytes += (blocks - 1) * size_of_metadata;
+    heapFree(arena, payloadOf(first));
+}
+
+/************* SLABS *************/
+/* Requests of up to slab_max_size bytes are served from slabs instead of the arenas' heaps. A slab is a
+ * SLAB_PAGE_SIZE page, aligned to its size, that starts with a SlabPage header and is carved into
+ * equal slots of a 16 bytes multiple. Slots have no header of their own: sfree finds the page by
+ * masking the pointer, and tells slab pointers apart because all the pages come from one reserved
+ * region. Free slots of a page are linked through their first word.
+ *
+ * Every arena keeps its own pages, under its slab_lock, so threads on different arenas never share a
+ * slab lock; a slot freed by another thread goes back to the arena of its page. Only carving a page out
+ * of the region and the pool of empty pages are shared, under slab_pool_lock, which is taken while
+ * holding an arena's slab_lock. */
+struct SlabPage {
+    SlabPage* next;   // next page of the same class with a free slot
+    SlabPage* prev;
+    void* free_slots; // slots that were handed out and freed since
+    char* unused;     // slots from here to the end of the page were never handed out
+    Arena* arena;     // the arena whose lists the page is on
+    unsigned slot_size;
+    unsigned used;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(SlabPage) + 15) & ~(size_t) 15)
+
+static size_t slab_max_size = 256;
+static char* slab_region = nullptr;
+static char* slab_top = nullptr;           // pages below it were carved already
+static SlabPage* slab_free_pages = nullptr; // empty pages, linked through next
+static pthread_mutex_t slab_pool_lock = PTHREAD_MUTEX_INITIALIZER; // guards the three above
+
+static bool isSlab(void* p){
+    return slab_region && (char*) p >= slab_region && (char*) p < slab_region + SLAB_REGION_SIZE;
+}
+
+static SlabPage* slabPageOf(void* p){
+    return (SlabPage*) ((uintptr_t) p & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+}
+
+static bool slabPageFull(SlabPage* page){
+    return !page->free_slots && page->unused + page->slot_size > (char*) page + SLAB_PAGE_SIZE;
+}
+
+static void slabPartialPush(Arena* arena, int cls, SlabPage* page){
+    page->prev = nullptr;
+    page->next = arena->slab_partial[cls];
+    if (arena->slab_partial[cls]){
+        arena->slab_partial[cls]->prev = page;
+    }
+    arena->slab_partial[cls] = page;
+}
+
+static void slabPartialRemove(Arena* arena, int cls, SlabPage* page){
+    if (page->prev){
+        page->prev->next = page->next;
+    } else {
+        arena->slab_partial[cls] = page->next;
+    }
+    if (page->next){
+        page->next->prev = page->prev;
+    }
+}
+
+/***
+ * Gets an empty page for a class of an arena, reusing a page freed by any class or arena before carving
+ * a new one out of the slab region. The caller must hold the arena's slab_lock.
+ *
+ * @return The page or NULL if the region is exhausted.
+ */
+static SlabPage* slabPageAlloc(Arena* arena, int cls){
+    LockGuard guard(&slab_pool_lock);
+    SlabPage* page = slab_free_pages;
+    if (page){
+        slab_free_pages = page->next;
+    } else {
+        if (!slab_region){
+            void* region = mmap(nullptr, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+            if (region == (void*) -1){
+                return nullptr;
+            }
+            slab_region = (char*) region;
+            slab_top = slab_region;
+        }
+        if (slab_top == slab_region + SLAB_REGION_SIZE){
+            return nullptr;
+        }
+        page = (SlabPage*) slab_top;
+        slab_top += SLAB_PAGE_SIZE;
+    }
+    page->free_slots = nullptr;
+    page->unused = (char*) page + SLAB_HEADER_SIZE;
+    page->arena = arena;
+    page->slot_size = cls * SMALL_BIN_WIDTH;
+    page->used = 0;
+    arena->slab_pages[cls]++;
+    return page;
+}
+
+/***
+ * Takes a slot of the given class from an arena's slabs. The caller must hold the arena's slab_lock.
+ *
+ * @return The slot or NULL if no page could be found.
+ */
+static void* slabTake(Arena* arena, int cls){
+    SlabPage* page = arena->slab_partial[cls];
+    if (!page){
+        page = slabPageAlloc(arena, cls);
+        if (!page){
+            return nullptr;
+        }
+        slabPartialPush(arena, cls, page);
+    }
+    void* slot = page->free_slots;
+    if (slot){
+        page->free_slots = *(void**) slot;
+    } else {
+        slot = page->unused;
+        page->unused += page->slot_size;
+    }
+    page->used++;
+    arena->slab_used[cls]++;
+    if (slabPageFull(page)){
+        slabPartialRemove(arena, cls, page);
+    }
+    return slot;
+}
+
+static void* slabAlloc(size_t size){
+    Arena* arena = threadArena();
+    LockGuard guard(&arena->slab_lock);
+    return slabTake(arena, (size + SMALL_BIN_WIDTH - 1) / SMALL_BIN_WIDTH);
+}
+
+/***
+ * Returns a slot to its page. A page that becomes empty goes back to the shared pool of free pages,
+ * unless it is the only page of its class with free slots. The caller must hold the slab_lock of the
+ * page's arena.
+ */
+static void slabPut(void* p){
+    SlabPage* page = slabPageOf(p);
+    Arena* arena = page->arena;
+    int cls = page->slot_size / SMALL_BIN_WIDTH;
+    if (slabPageFull(page)){
+        slabPartialPush(arena, cls, page);
+    }
+    *(void**) p = page->free_slots;
+    page->free_slots = p;
+    page->used--;
+    arena->slab_used[cls]--;
+    if (page->used == 0 && (page->prev || page->next)){
+        slabPartialRemove(arena, cls, page);
+        arena->slab_pages[cls]--;
+        LockGuard guard(&slab_pool_lock);
+        page->slot_size = 0;
+        page->next = slab_free_pages;
+        slab_free_pages = page;
+    }
+}
+
+/***
+ * The slot is live, so the page cannot change arenas while its arena is read without a lock.
+ */
+static void slabFree(void* p){
+    LockGuard guard(&slabPageOf(p)->arena->slab_lock);
+    slabPut(p);
+}
+
+/************* THREAD CACHE *************/
+/* Every thread keeps a magazine of recently freed small blocks per 16 bytes class. A block of size s
+ * sits in magazine s/16 and serves requests of up to 16*(s/16) bytes, so the common smalloc/sfree pair
+ * never takes an arena or slab lock. Magazines are refilled and flushed half a magazine at a time. Blocks
+ * sitting in a magazine still count as allocated in the statistics. */
+struct ThreadCache {
+    void* blocks[TCACHE_CLASSES][TCACHE_MAGAZINE];
+    int count[TCACHE_CLASSES];
+};
+
+static bool tcache_enabled = false;
+static thread_local ThreadCache tcache;
+static thread_local bool tcache_registered = false;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/***
+ * Returns blocks from a magazine to the slabs or arenas that own them until only keep are left in it.
+ * A magazine may hold blocks of several arenas, the lock is only switched when the owner changes. It
+ * is dropped before a slot goes back to its slab, since no slab lock is taken under an arena's lock.
+ */
+static void tcacheFlush(ThreadCache* cache, int cls, int keep){
+    Arena* locked = nullptr;
+    while (cache->count[cls] > keep){
+        void* p = cache->blocks[cls][--cache->count[cls]];
+        if (isSlab(p)){
+            if (locked){
+                pthread_mutex_unlock(&locked->lock);
+                locked = nullptr;
+            }
+            slabFree(p);
+            continue;
+        }
+        Arena* arena = arenaOf(headerOf(p));
+        if (arena != locked){
+            if (locked){
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        heapFree(arena, p);
+    }
+    if (locked){
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/***
+ * Empties every magazine of a thread. Runs as the tcache_key destructor when the thread exits.
+ */
+static void tcacheDestroy(void* cache){
+    for (int cls = 0; cls < TCACHE_CLASSES; cls++){
+        tcacheFlush((ThreadCache*) cache, cls, 0);
+    }
+}
+
+static void tcacheKeyCreate(){
+    pthread_key_create(&tcache_key, tcacheDestroy);
+}
+
+/***
+ * Makes sure the cache of the current thread is flushed when the thread exits.
+ */
+static void tcacheRegister(){
+    if (tcache_registered){
+        return;
+    }
+    pthread_once(&tcache_key_once, tcacheKeyCreate);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache_registered = true;
+}
+
+/***
+ * Fills half of an empty magazine with fresh blocks from the slabs or the heap.
+ */
+static void tcacheRefill(int cls){
+    tcacheRegister();
+    Arena* arena = threadArena();
+    if ((size_t) cls * SMALL_BIN_WIDTH <= slab_max_size){
+        LockGuard guard(&arena->slab_lock);
+        while (tcache.count[cls] < TCACHE_MAGAZINE / 2){
+            void* block = slabTake(arena, cls);
+            if (!block){
+                break;
+            }
+            tcache.blocks[cls][tcache.count[cls]++] = block;
+        }
+        if (tcache.count[cls] > 0){
+            return;
+        }
+    }
+    LockGuard guard(&arena->lock);
+    while (tcache.count[cls] < TCACHE_MAGAZINE / 2){
+        void* block = heapAlloc(arena, cls * SMALL_BIN_WIDTH, nullptr);
+        if (!block){
+            return;
+        }
+        tcache.blocks[cls][tcache.count[cls]++] = block;
+    }
+}
+
+/***
+ * Puts a freed block in its magazine, making room first if the magazine is full.
+ */
+static void tcachePush(int cls, void* p){
+    tcacheRegister();
+    if (tcache.count[cls] == TCACHE_MAGAZINE){
+        tcacheFlush(&tcache, cls, TCACHE_MAGAZINE / 2);
+    }
+    tcache.blocks[cls][tcache.count[cls]++] = p;
+}
+
+/************* TRACING *************/
+/* While a trace is running every public call appends a TraceRecord to a buffer of the calling thread,
+ * which goes to the trace file in one write() when it fills up, so recording costs a clock read and an
+ * uncontended lock per call. The buffers are mmap'ed and never freed: the buffer of a thread that exits
+ * is flushed and adopted by the next thread that starts recording. Records of different threads are not
+ * in order in the file, the replay sorts them by time. */
+struct TraceBuffer {
+    TraceBuffer* next;
+    pthread_mutex_t lock;
+    bool in_use;
+    size_t count;
+    TraceRecord records[TRACE_BUFFER_RECORDS];
+};
+
+static bool tracing = false;
+static int trace_fd = -1;
+static unsigned short trace_threads = 0;
+static TraceBuffer* trace_buffers = nullptr;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local TraceBuffer* trace_buffer = nullptr;
+static thread_local unsigned short trace_thread = 0;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+/***
+ * Writes out the records of a buffer. The caller must hold the buffer's lock.
+ */
+static void traceFlush(TraceBuffer* buffer){
+    LockGuard guard(&trace_lock);
+    const char* data = (const char*) buffer->records;
+    size_t left = buffer->count * sizeof(TraceRecord);
+    while (trace_fd >= 0 && left > 0){
+        ssize_t written = write(trace_fd, data, left);
+        if (written < 0){
+            break;
+        }
+        data += written;
+        left -= written;
+    }
+    buffer->count = 0;
+}
+
+/***
+ * Flushes the buffer of an exiting thread and hands it over to the next thread. Runs as the trace_key
+ * destructor.
+ */
+static void traceRelease(void* p){
+    TraceBuffer* buffer = (TraceBuffer*) p;
+    LockGuard guard(&buffer->lock);
+    traceFlush(buffer);
+    buffer->in_use = false;
+    trace_buffer = nullptr;
+}
+
+static void traceKeyCreate(){
+    pthread_key_create(&trace_key, traceRelease);
+}
+
+/***
+ * Gives the calling thread a buffer, reusing one left by an exited thread if there is one.
+ *
+ * @return The buffer or NULL if a new one could not be mapped.
+ */
+static TraceBuffer* traceBufferGet(){
+    pthread_once(&trace_key_once, traceKeyCreate);
+    LockGuard guard(&trace_lock);
+    TraceBuffer* buffer = trace_buffers;
+    while (buffer && buffer->in_use){
+        buffer = buffer->next;
+    }
+    if (!buffer){
+        buffer = (TraceBuffer*) mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (buffer == (void*) -1){
+            return nullptr;
+        }
+        pthread_mutex_init(&buffer->lock, nullptr);
+        buffer->count = 0;
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+    }
+    buffer->in_use = true;
+    if (!trace_thread){
+        trace_thread = ++trace_threads;
+    }
+    pthread_setspecific(trace_key, buffer);
+    trace_buffer = buffer;
+    return buffer;
+}
+
+/***
+ * Appends a record to the calling thread's buffer.
+ *
+ * @param op: One of the TRACE_* operations.
+ * @param address: The block returned, or the block freed for sfree.
+ * @param old_address: The block passed to srealloc, or the alignment for smemalign.
+ * @param size: The requested size.
+ */
+static void traceRecord(int op, void* address, void* old_address, size_t size){
+    TraceBuffer* buffer = trace_buffer ? trace_buffer : traceBufferGet();
+    if (!buffer){
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    LockGuard guard(&buffer->lock);
+    if (!tracing){
+        return;
+    }
+    TraceRecord* record = &buffer->records[buffer->count++];
+    record->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->address = (uintptr_t) address;
+    record->old_address = (uintptr_t) old_address;
+    record->size = size;
+    record->thread = trace_thread;
+    record->op = op;
+    std::memset(record->reserved, 0, sizeof(record->reserved));
+    if (buffer->count == TRACE_BUFFER_RECORDS){
+        traceFlush(buffer);
+    }
+}
+
+int smalloc_trace_start(const char* path){
+    LockGuard guard(&trace_lock);
+    if (tracing){
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return 0;
+    }
+    if (write(fd, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != sizeof(TRACE_MAGIC) - 1){
+        close(fd);
+        return 0;
+    }
+    trace_fd = fd;
+    tracing = true;
+    return 1;
+}
+
+void smalloc_trace_stop(){
+    TraceBuffer* buffers;
+    {
+        LockGuard guard(&trace_lock);
+        if (!tracing){
+            return;
+        }
+        tracing = false;
+        buffers = trace_buffers;
+    }
+    /******** The list only ever grows at its head, so it can be walked without trace_lock ********/
+    for (TraceBuffer* buffer = buffers; buffer; buffer = buffer->next){
+        LockGuard guard(&buffer->lock);
+        traceFlush(buffer);
+    }
+    LockGuard guard(&trace_lock);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/************* PUBLIC API *************/
+/***
+ * The body of smalloc, also used by the other public functions so that only the outer call is traced.
+ *
+ * @param dirty: If not NULL, lowered to the length of the payload's prefix that may not read as
+ * zeros, see heapAlloc.
+ */
+static void* allocate(size_t size, size_t* dirty){
+    if(size==0||size>MAX_REQUEST){
+        return nullptr ;
+    }
+    if (tcache_enabled && size <= (TCACHE_CLASSES - 1) * SMALL_BIN_WIDTH){
+        int cls = (size + SMALL_BIN_WIDTH - 1) / SMALL_BIN_WIDTH;
+        if (tcache.count[cls] == 0){
+            tcacheRefill(cls);
+        }
+        if (tcache.count[cls] > 0){
+            return tcache.blocks[cls][--tcache.count[cls]];
+        }
+    }
+    if (size <= slab_max_size){
+        void* slot = slabAlloc(size);
+        if (slot){
+            return slot;
+        }
+    }
+    if (size >= Policy::mmap_threshold){
+        return mmapAlloc(size, dirty);
+    }
+    Arena* arena = threadArena();
+    void* p;
+    {
+        LockGuard guard(&arena->lock);
+        p = heapAlloc(arena, size, dirty);
+    }
+    if (!p && arena != &main_arena){
+        /******** The thread's arena is full, fall back to the main one ********/
+        LockGuard guard(&main_arena.lock);
+        p = heapAlloc(&main_arena, size, dirty);
+    }
+    return p;
+}
+
+/***
+ * The body of sfree.
+ */
+static void release(void* p){
+    bool slab = isSlab(p);
+    MallocMetadata *metadata = headerOf(p);
+    if (tcache_enabled){
+        size_t cls = (slab ? slabPageOf(p)->slot_size : blockSize(metadata)) / SMALL_BIN_WIDTH;
+        /******* A large block that srealloc shrank in place is still mmap'ed, it is not cached ******/
+        if ((slab || !(metadata->size & (FREE_BIT | MMAP_BIT))) && cls > 0 && cls < TCACHE_CLASSES){
+            tcachePush(cls, p);
+            return;
+        }
+    }
+    if (slab){
+        slabFree(p);
+        return;
+    }
+    if (isMmap(metadata)){
+        mmapFree(metadata);
+        return;
+    }
+    /******** Frees from other threads go back to the arena that owns the block ********/
+    Arena* arena = arenaOf(metadata);
+    LockGuard guard(&arena->lock);
+    heapFree(arena, p);
+}
+
+/***
+ * The body of smemalign for a power of two alignment. Blocks aligned to 16 bytes are ordinary blocks;
+ * the others skip the thread cache and the slabs, whose slots are only 16 bytes aligned.
+ */
+static void* alignedAllocate(size_t alignment, size_t size){
+    if (size == 0 || size > MAX_REQUEST || alignment > MAX_REQUEST){
+        return nullptr;
+    }
+    if (alignment <= 16){
+        return allocate(size, nullptr);
+    }
+    if (alignSize(size) + alignment + size_of_metadata + MIN_PAYLOAD >= Policy::mmap_threshold){
+        return mmapAlignedAlloc(alignment, size);
+    }
+    Arena* arena = threadArena();
+    void* p;
+    {
+        LockGuard guard(&arena->lock);
+        p = heapAlignedAlloc(arena, alignment, size);
+    }
+    if (!p && arena != &main_arena){
+        LockGuard guard(&main_arena.lock);
+        p = heapAlignedAlloc(&main_arena, alignment, size);
+    }
+    return p;
+}
+
+/***
+ * The body of srealloc for a valid size and a non NULL block.
+ */
+static void* reallocate(void* oldp, size_t size){
+
+    if (isSlab(oldp)){
+        size_t slot_size = slabPageOf(oldp)->slot_size;
+        if (size <= slot_size){
+            return oldp;
+        }
+        void* addr = allocate(size, nullptr);
+        if (!addr){
+            return nullptr;
+        }
+        std::memcpy(addr, oldp, slot_size);
+        release(oldp);
+        return addr;
+    }
+
+    MallocMetadata* metadata = headerOf(oldp);
+    if (isMmap(metadata)){
+        void* moved = mmapRealloc(metadata, size);
+        if (moved){
+            return moved;
+        }
+        void* mmapp_address = allocate(size, nullptr);
+        if(mmapp_address == nullptr){
+            return nullptr;
+        }
+        std::memcpy(mmapp_address, oldp, std::min(size, blockSize(metadata)));
+        release(oldp);
+        return mmapp_address;
+    }
+    Arena* arena = arenaOf(metadata);
+    {
+        LockGuard guard(&arena->lock);
+        void* addr = heapRealloc(arena, oldp, size);
+        if (addr || arena == &main_arena){
+            return addr;
+        }
+    }
+    /******** The block's arena is full, move it to wherever allocate falls back to ********/
+    void* addr = allocate(size, nullptr);
+    if (!addr){
+        return nullptr;
+    }
+    std::memcpy(addr, oldp, std::min(size, blockSize(metadata)));
+    release(oldp);
+    return addr;
+}
+
+void* smalloc(size_t size){
+    void* p = allocate(size, nullptr);
+    if (tracing){
+        traceRecord(TRACE_MALLOC, p, nullptr, size);
+    }
+    return p;
+}
+
+void* scalloc(size_t num, size_t size){
+    size_t size_num;
+    if(__builtin_mul_overflow(num, size, &size_num)||size_num==0||size_num>MAX_REQUEST){
+        return nullptr ;
+    }
+    /******** Fresh heap growth, fresh mappings and dropped pages already read as zeros ********/
+    size_t dirty = size_num;
+    void* address = allocate(size_num, &dirty);
+    if (tracing){
+        traceRecord(TRACE_CALLOC, address, nullptr, size_num);
+    }
+    if(address== nullptr){
+        return nullptr ;
+    }
+    std::memset(address,0,dirty);
+    return address ;
+}
 
-static void listInsertToTail(MallocMetadata* entry){
-    if ( list_head == nullptr ){
-        list_head = entry;
-        entry->next = nullptr;
-        entry->prev = nullptr;
+void sfree(void* p){
+    if (p == nullptr){
         return;
     }
+    /******** Traced before the block can be handed out again, so the replay sees the free first ********/
+    if (tracing){
+        traceRecord(TRACE_FREE, p, nullptr, 0);
+    }
+    release(p);
+}
 
-    MallocMetadata* it = list_head;
-    while (it->next){
-        it = it->next;
+void sfree_sized(void* p, size_t size){
+    if (p == nullptr){
+        return;
+    }
+    if (tracing){
+        traceRecord(TRACE_FREE, p, nullptr, 0);
     }
+    if (!isSlab(p)){
+        release(p);
+        return;
+    }
+    assert(size <= slabPageOf(p)->slot_size);
+    /******** The slot holds at least alignSize(size) bytes, that is enough for the magazine of size ********/
+    int cls = (size + SMALL_BIN_WIDTH - 1) / SMALL_BIN_WIDTH;
+    if (tcache_enabled && cls > 0){
+        tcachePush(cls, p);
+        return;
+    }
+    slabFree(p);
+}
 
-    it->next = entry;
-    entry->prev = it;
-    entry->next = nullptr;
+size_t susable_size(void* p){
+    if (p == nullptr){
+        return 0;
+    }
+    if (isSlab(p)){
+        return slabPageOf(p)->slot_size;
+    }
+    return blockSize(headerOf(p));
 }
 
-static MallocMetadata* listGetTail(){
-    if ( list_head == nullptr ){
+void* srealloc(void* oldp, size_t size){
+    if(size==0 || size>MAX_REQUEST){
         return nullptr;
     }
-
-    MallocMetadata* it = list_head;
-    while (it->next){
-        it = it->next;
+    void* p = oldp ? reallocate(oldp, size) : allocate(size, nullptr);
+    if (tracing){
+        traceRecord(TRACE_REALLOC, p, oldp, size);
     }
+    return p;
+}
 
-    return it;
+void* smemalign(size_t alignment, size_t size){
+    if (alignment == 0 || (alignment & (alignment - 1))){
+        return nullptr;
+    }
+    void* p = alignedAllocate(alignment, size);
+    if (tracing){
+        traceRecord(TRACE_MEMALIGN, p, (void*) alignment, size);
+    }
+    return p;
 }
 
+void* saligned_alloc(size_t alignment, size_t size){
+    return smemalign(alignment, size);
+}
 
-/***
- * Insert an entry into the histogram.
- *
- * Inserts the entry in index size/1024 (example: an entry of size 800 will go in index 0, an entry of size
- * 2000 will go in index 1).
- *
- * @param entry: The entry.
- */
-void hist_insert( MallocMetadata* entry ){
-    assert(entry->is_free);
-    int index = entry->size / KILO;
-    MallocMetadata* it = hist[index];
-    if (!it) {
-        hist[index] = entry;
-        entry->prev2 = nullptr;
-        entry->next2 = nullptr;
-        return;
+int sposix_memalign(void** memptr, size_t alignment, size_t size){
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1))){
+        return EINVAL;
     }
-    while (it->next2) {
-        if (entry->size > it->size){
-            MallocMetadata* tmp = it->next2;
-            it->next2 = entry;
-            entry->prev2 = it;
-            entry->next2 = tmp;
-            tmp->prev2 = entry;
-            break;
-        }
-        it = it->next2;
+    if (size == 0){
+        *memptr = nullptr;
+        return 0;
     }
-    if (entry->size > it->size){
-        MallocMetadata* tmp = it->next2;
-        it->next2 = entry;
-        entry->prev2 = it;
-        entry->next2 = tmp;
-        tmp->prev2 = entry;
-    } else{
-        it->next2 = entry;
-        entry->prev2 = it;
-        entry->next2 = nullptr;
+    void* p = smemalign(alignment, size);
+    if (!p){
+        return ENOMEM;
     }
+    *memptr = p;
+    return 0;
 }
 
-/***
- * Removes an entry from the histogram. This function assumes that the argument
- * provided is a valid address to a metadata struct and that it is already in the hist.
- *
- * @param entry: the entry.
- */
-void hist_remove( MallocMetadata* entry ){
-    if (!entry->is_free){
-        return;
+size_t smalloc_batch(size_t size, size_t count, void** out){
+    if (size == 0 || size > MAX_REQUEST){
+        return 0;
+    }
+    size_t done = 0;
+    if (size <= slab_max_size){
+        Arena* arena = threadArena();
+        LockGuard guard(&arena->slab_lock);
+        int cls = (size + SMALL_BIN_WIDTH - 1) / SMALL_BIN_WIDTH;
+        while (done < count && (out[done] = slabTake(arena, cls))){
+            done++;
+        }
+    } else if (alignSize(size) < Policy::mmap_threshold){ // heapAllocBatch fits at least one block under it
+        Arena* arena = threadArena();
+        LockGuard guard(&arena->lock);
+        while (done < count){
+            size_t carved = heapAllocBatch(arena, size, count - done, out + done);
+            if (!carved){
+                break;
+            }
+            done += carved;
+        }
     }
-    int index = entry->size / KILO;
-    if ( !(entry->prev2) ) {
-        hist[index] = entry->next2;
-        entry->next2 = nullptr;
+    /******** Large blocks, and whatever the fast paths could not provide, one at a time ********/
+    while (done < count && (out[done] = allocate(size, nullptr))){
+        done++;
     }
-    else{
-        MallocMetadata* tmp = entry->prev2;
-        tmp->next2 = entry->next2;
-        if ( entry->next2 ) {
-            entry->next2->prev2 = tmp;
+    if (tracing){
+        for (size_t i = 0; i < done; i++){
+            traceRecord(TRACE_MALLOC, out[i], nullptr, size);
         }
-        entry->next2 = nullptr;
-        entry->prev2 = nullptr;
     }
+    return done;
 }
 
-/***
- * Finds and removes a block of the given size. This function does not change the metadata
- * that it returns to mark it as not free, it should be done outside the function.
- *
- * @param size
- * @return A metadata block of at least size or NULL if no block was found.
- */
-MallocMetadata* hist_search(size_t size) {
-    size_t index = size / KILO;
-    while (index < HIST_SIZE){
-        MallocMetadata* it = hist[index];
-
-        while ( it ){
-            if (it->size >= size){
-                hist_remove(it);
-                return it;
+void sfree_batch(void** ptrs, size_t count){
+    if (tracing){
+        for (size_t i = 0; i < count; i++){
+            if (ptrs[i]){
+                traceRecord(TRACE_FREE, ptrs[i], nullptr, 0);
             }
-
-            it = it->next2;
         }
-
-        index++;
     }
+    std::sort(ptrs, ptrs + count);
+    pthread_mutex_t* locked = nullptr;
+    size_t i = 0;
+    while (i < count){
+        void* p = ptrs[i++];
+        if (!p || (i > 1 && p == ptrs[i - 2])){
+            continue;
+        }
+        pthread_mutex_t* lock = nullptr;
+        MallocMetadata* metadata = headerOf(p);
+        Arena* arena = nullptr;
+        if (isSlab(p)){
+            lock = &slabPageOf(p)->arena->slab_lock;
+        } else if (!isMmap(metadata)){
+            arena = arenaOf(metadata);
+            lock = &arena->lock;
+        }
+        if (lock != locked){
+            if (locked){
+                pthread_mutex_unlock(locked);
+            }
+            if (lock){
+                pthread_mutex_lock(lock);
+            }
+            locked = lock;
+        }
+        if (!lock){
+            mmapFree(metadata);
+        } else if (!arena){
+            slabPut(p);
+        } else if (!isFree(metadata)){
+            /******** Extend the run while the next pointer is the block right after it ********/
+            MallocMetadata* last = metadata;
+            size_t blocks = 1;
+            while (i < count){
+                MallocMetadata* next = nextBlock(arena, last);
+                if (!next || ptrs[i] != payloadOf(next) || isFree(next)){
+                    break;
+                }
+                last = next;
+                blocks++;
+                i++;
+            }
+            heapFreeRun(arena, metadata, last, blocks);
+        }
+    }
+    if (locked){
+        pthread_mutex_unlock(locked);
+    }
+}
 
-    return nullptr;
+int smallopt(int param, int value){
+    switch (param){
+        case M_TCACHE:
+            if (!value && tcache_enabled){
+                tcacheDestroy(&tcache);
+            }
+            tcache_enabled = value != 0;
+            return 1;
+        case M_ARENAS:
+            if (value < 1 || value > MAX_ARENAS){
+                return 0;
+            }
+            arena_count = value;
+            return 1;
+        case M_ARENA_PER_CPU:
+            arena_per_cpu = value != 0;
+            return 1;
+        case M_SLAB_MAX:
+            if (value < 0 || value > (SLAB_CLASSES - 1) * SMALL_BIN_WIDTH){
+                return 0;
+            }
+            slab_max_size = value;
+            return 1;
+        case M_TRIM_THRESHOLD:
+            if (value < 0){
+                return 0;
+            }
+            trim_threshold = value;
+            return 1;
+        case M_MADVISE_THRESHOLD:
+            if (value < 0){
+                return 0;
+            }
+            madvise_threshold = value;
+            return 1;
+        case M_HUGEPAGES:
+            if (value < 0 || value > 2){
+                return 0;
+            }
+            hugepage_mode = value;
+            return 1;
+        case M_HEAP_GROWTH:
+            if (value < 0){
+                return 0;
+            }
+            heap_growth = ((size_t) value + 15) & ~(size_t) 15;
+            return 1;
+        case M_FASTBIN_MAX:
+            if (value < 0 || value > (FASTBIN_CLASSES - 1) * SMALL_BIN_WIDTH){
+                return 0;
+            }
+            fastbin_max = value;
+            if (!fastbin_max){
+                for (int i = 0; i < MAX_ARENAS; i++){
+                    if (arenas[i]){
+                        LockGuard guard(&arenas[i]->lock);
+                        fastbinConsolidate(arenas[i]);
+                    }
+                }
+            }
+            return 1;
+        case M_MMAP_CACHE_MAX: {
+            if (value < 0){
+                return 0;
+            }
+            CachedRegion* evicted;
+            {
+                LockGuard guard(&mmap_lock);
+                mmap_cache_max = value;
+                evicted = mmapCacheEvict(mmap_cache_max);
+            }
+            mmapCacheUnmap(evicted);
+            return 1;
+        }
+        default:
+            return 0;
+    }
 }
 
-/************* CHALLENGE 1 *************/
-static void splitBlock(MallocMetadata* block, size_t size) {
-    assert(block);
+/************* REGIONS *************/
+/* A region hands out memory by bumping a pointer through chunks it gets from smalloc, so its objects
+ * have no header and are never freed one by one. Reset rewinds the pointer to the first chunk and keeps
+ * the chunks for the next round; only objects too large to share a chunk are smalloc'ed on their own,
+ * and freed by reset. */
+struct RegionChunk {
+    RegionChunk* next;
+    size_t size;            // bytes after this header
+};
 
-    MallocMetadata* split = (MallocMetadata*) ( ( (char*)  block + size_of_metadata + size) );
-    split->size = block->size - size - size_of_metadata;
+#define REGION_HEADER_SIZE ((sizeof(RegionChunk) + 15) & ~(size_t) 15)
+#define REGION_CHUNK_SIZE (64 * KILO) // default chunk size, below the mmap threshold
+
+struct SRegion {
+    RegionChunk* chunks;    // in the order they were added
+    RegionChunk* current;   // the chunk being bumped through, NULL before the first allocation
+    char* top;              // next free byte of current
+    char* end;              // end of current
+    RegionChunk* large;     // objects of their own, freed by reset
+    size_t chunk_size;
+};
 
-    split->is_free = true;
-    split->prev = block;
-    split->next = block->next;
-    if (split->next) {
-        split->next->prev = split;
+/***
+ * Moves to the next chunk, reusing the ones kept by sregion_reset before adding a new one.
+ *
+ * @return false if smalloc failed.
+ */
+static bool regionNextChunk(SRegion* region){
+    RegionChunk* chunk = region->current ? region->current->next : region->chunks;
+    if (!chunk){
+        chunk = (RegionChunk*) smalloc(REGION_HEADER_SIZE + region->chunk_size);
+        if (!chunk){
+            return false;
+        }
+        chunk->next = nullptr;
+        chunk->size = region->chunk_size;
+        if (region->current){
+            region->current->next = chunk;
+        } else {
+            region->chunks = chunk;
+        }
     }
-    hist_insert(split);
+    region->current = chunk;
+    region->top = (char*) chunk + REGION_HEADER_SIZE;
+    region->end = region->top + chunk->size;
+    return true;
+}
 
-    block->next = split;
-    block->size = size;
+SRegion* sregion_create(size_t chunk_size){
+    SRegion* region = (SRegion*) smalloc(sizeof(SRegion));
+    if (!region){
+        return nullptr;
+    }
+    region->chunks = region->current = region->large = nullptr;
+    region->top = region->end = nullptr;
+    region->chunk_size = chunk_size ? alignSize(chunk_size) : REGION_CHUNK_SIZE - REGION_HEADER_SIZE;
+    return region;
 }
 
-/************* CHALLENGE 2 *************/
-static bool mergeNextBlock(MallocMetadata* block) {
-    assert(block);
-    if (block->next == nullptr){
-        return false;
+void* sregion_alloc(SRegion* region, size_t size){
+    if (size == 0 || size > MAX_REQUEST){
+        return nullptr;
     }
-    if (!block->next->is_free){
-        return false;
+    size = alignSize(size);
+    if (size > (size_t) (region->end - region->top)){
+        if (size > region->chunk_size / 4){
+            /******** Would waste too much of a chunk, gets a block of its own ********/
+            RegionChunk* large = (RegionChunk*) smalloc(REGION_HEADER_SIZE + size);
+            if (!large){
+                return nullptr;
+            }
+            large->next = region->large;
+            large->size = size;
+            region->large = large;
+            return (char*) large + REGION_HEADER_SIZE;
+        }
+        if (!regionNextChunk(region)){
+            return nullptr;
+        }
     }
-    block->next = block->next->next;
-    if(block->next){
-        block->next->prev = block;
+    void* p = region->top;
+    region->top += size;
+    return p;
+}
+
+void sregion_reset(SRegion* region){
+    while (region->large){
+        RegionChunk* next = region->large->next;
+        sfree(region->large);
+        region->large = next;
     }
+    region->current = nullptr;
+    region->top = region->end = nullptr;
+}
 
-    block->size += size_of_metadata + block->next->size;
-    return true;
+void sregion_destroy(SRegion* region){
+    if (!region){
+        return;
+    }
+    sregion_reset(region);
+    while (region->chunks){
+        RegionChunk* next = region->chunks->next;
+        sfree(region->chunks);
+        region->chunks = next;
+    }
+    sfree(region);
 }
 
-void* smalloc(size_t size){
-    if(size==0||size>100000000){
-        return nullptr ;
+/***
+ * Sums the counters of all the arenas.
+ */
+static HeapStats heapStats(){
+    HeapStats total = {};
+    for (int i = 0; i < MAX_ARENAS; i++){
+        if (!arenas[i]){
+            continue;
+        }
+        LockGuard guard(&arenas[i]->lock);
+        total.blocks += arenas[i]->stats.blocks;
+        total.bytes += arenas[i]->stats.bytes;
+        total.free_blocks += arenas[i]->stats.free_blocks;
+        total.free_bytes += arenas[i]->stats.free_bytes;
     }
-    if (size < 128*KILO) {
-       MallocMetadata* free_block = hist_search(size);
-       if ( !free_block ) {
-           /******** No free large enough block was found ********/
-
-           /******** Wilderness block *************/
-           MallocMetadata* last_block = listGetTail();
-           if ( last_block && last_block->is_free ) {
-               size_t diff = size - last_block->size;
-               void* addr = sbrk(diff);
-               if (addr == (void*) -1){
-                   return nullptr;
-               }
-               last_block->is_free = false;
-               last_block->size = size;
-               return  (((char*) last_block) + size_of_metadata);
-           }
-
-           void* block_start = sbrk(size + size_of_metadata);
-           if ( block_start == (void*) -1 ){
-               return nullptr;
-           }
-           MallocMetadata* metadata = (MallocMetadata*) block_start;
-           metadata->size = size;
-           metadata->is_free = false;
-           listInsertToTail(metadata);
-           return (((char*)block_start) + size_of_metadata);
-       }
-
-       /***** A free block large enough was found *****/
-
-       if ( (free_block->size - size) >= (size_of_metadata + 128) ){
-           /******** Need to split the block ***********/
-           splitBlock(free_block, size);
-           free_block->is_free = false;
-           return (((char*) free_block) + size_of_metadata);
-       } else {
-           /******** No need to split the block ***********/
-           free_block->is_free = false;
-           return  (((char*) free_block) + size_of_metadata);
-       }
-    } else {
-        void* mmap_addr = mmap(nullptr, size + size_of_metadata, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-        if(mmap_addr == (void*)(-1)){
-            return nullptr;
+    return total;
+}
+
+/***
+ * Sums the slab statistics over all the classes of all the arenas.
+ *
+ * @param slots: Set to the number of slots handed out.
+ * @param bytes: Set to the total size of those slots.
+ * @param pages: Set to the number of pages in use.
+ */
+static void slabStats(size_t* slots, size_t* bytes, size_t* pages){
+    *slots = *bytes = *pages = 0;
+    for (int i = 0; i < MAX_ARENAS; i++){
+        Arena* arena = arenas[i];
+        if (!arena){
+            continue;
         }
-        if(mmap_list_head == nullptr){
-            mmap_list_head = (MallocMetadata*)mmap_addr;
-            mmap_list_head->is_free = false;
-            mmap_list_head->size = size;
-            mmap_list_head->next = nullptr;
-            mmap_list_head->prev = nullptr;
-            return (((char*) mmap_list_head) + size_of_metadata);
+        LockGuard guard(&arena->slab_lock);
+        for (int cls = 1; cls < SLAB_CLASSES; cls++){
+            *slots += arena->slab_used[cls];
+            *bytes += arena->slab_used[cls] * cls * SMALL_BIN_WIDTH;
+            *pages += arena->slab_pages[cls];
+        }
+    }
+}
+
+#ifdef MALLOC_DEBUG
+/***
+ * Walks every arena and the mmap list and asserts that the running counters match what is actually
+ * there. Compile with -DMALLOC_DEBUG to run it on every statistics query.
+ */
+static void statsCheck(){
+    for (int i = 0; i < MAX_ARENAS; i++){
+        if (!arenas[i]){
+            continue;
         }
-        MallocMetadata* it = mmap_list_head;
-        while(it->next){
-            it = it->next;
+        LockGuard guard(&arenas[i]->lock);
+        HeapStats walked = {};
+        for (MallocMetadata* it = arenas[i]->list_head; it; it = nextBlock(arenas[i], it)){
+            walked.blocks++;
+            walked.bytes += blockSize(it);
+            if (isFree(it)){
+                walked.free_blocks++;
+                walked.free_bytes += blockSize(it);
+            }
+            if (isZero(it)){
+                assert(isFree(it));
+                char* payload = (char*) payloadOf(it);
+                for (size_t j = MIN_PAYLOAD; j < blockSize(it); j++){
+                    assert(payload[j] == 0);
+                }
+            }
         }
-        MallocMetadata* new_block = (MallocMetadata*)mmap_addr;
-        it->next = new_block;
-        new_block->next = nullptr;
-        new_block->prev = it;
-        new_block->is_free = false;
-        new_block->size = size;
-        return (((char*) new_block) + size_of_metadata);
+        assert(walked.blocks == arenas[i]->stats.blocks);
+        assert(walked.bytes == arenas[i]->stats.bytes);
+        assert(walked.free_blocks == arenas[i]->stats.free_blocks);
+        assert(walked.free_bytes == arenas[i]->stats.free_bytes);
     }
+    LockGuard guard(&mmap_lock);
+    size_t blocks = 0, bytes = 0;
+    for (MallocMetadata* it = mmap_list_head; it; it = mmapLinks(it)->next){
+        /******* munmaped blocks are removed from the list, so none of them is free ******/
+        assert(!isFree(it));
+        blocks++;
+        bytes += blockSize(it);
+    }
+    assert(blocks == mmap_blocks);
+    assert(bytes == mmap_bytes);
 }
+#else
+static void statsCheck(){}
+#endif
 
+size_t _num_free_blocks(){
+    statsCheck();
+    return heapStats().free_blocks;
+}
 
 
-void* scalloc(size_t num, size_t size){
-    size_t size_num=num*size;
-    if(size_num==0||size_num>100000000){
-        return nullptr ;
-    }
-    void* address = smalloc(size_num);
-    if(address== nullptr){
-        return nullptr ;
-    }
-    std::memset(address,0,size_num);
-    return address ;
+size_t _num_free_bytes(){
+    statsCheck();
+    return heapStats().free_bytes;
 }
 
+size_t _num_allocated_blocks(){
+    statsCheck();
+    size_t slots, bytes, pages;
+    slabStats(&slots, &bytes, &pages);
+    HeapStats heap = heapStats();
+    LockGuard guard(&mmap_lock);
+    return heap.blocks + mmap_blocks + slots;
+}
 
-void sfree(void* p){
-    if (p == nullptr){
-        return;
+
+size_t _num_allocated_bytes(){
+    statsCheck();
+    size_t slots, bytes, pages;
+    slabStats(&slots, &bytes, &pages);
+    HeapStats heap = heapStats();
+    LockGuard guard(&mmap_lock);
+    return heap.bytes + mmap_bytes + bytes;
+}
+
+/***
+ * Header bytes: one MallocMetadata per arena block, a MallocMetadata and its MmapLinks per mmap block,
+ * and one SlabPage header per slab page shared by all of its slots.
+ */
+size_t _num_meta_data_bytes(){
+    statsCheck();
+    size_t slots, bytes, pages;
+    slabStats(&slots, &bytes, &pages);
+    HeapStats heap = heapStats();
+    LockGuard guard(&mmap_lock);
+    return heap.blocks*size_of_metadata + mmap_blocks*MMAP_HEADER_SIZE + pages*SLAB_HEADER_SIZE;
+}
+
+
+
+/************* INTROSPECTION *************/
+/***
+ * @return The smallest size that hist_index() maps to a bin, SIZE_MAX for the bins past the largest
+ * size, which only round the bins up to whole bitmap words.
+ */
+static size_t hist_min_size(int index){
+    if (index < SMALL_BINS){
+        return index * SMALL_BIN_WIDTH;
     }
-    MallocMetadata *metadata = (MallocMetadata *) ((char *) p - size_of_metadata);
-    if (metadata->is_free){
-        return;
+    int log = 10 + (index - SMALL_BINS) / Policy::large_bin_split;
+    if (log >= 64){
+        return SIZE_MAX;
     }
-    if(metadata->size <= 128 * KILO) {
-        metadata->is_free = true;
-        if (metadata->next->is_free){
-            hist_remove(metadata->next);
+    return ((size_t) 1 << log)
+           + (size_t) ((index - SMALL_BINS) % Policy::large_bin_split) * ((size_t) 1 << (log - Policy::large_bin_split_log));
+}
+
+/***
+ * @return The largest block in the highest non empty bin of the arena, 0 if it has no free block.
+ * The caller must hold the arena's lock.
+ */
+static size_t largestFreeBlock(Arena* arena){
+    for (int word = HIST_SIZE / 64 - 1; word >= 0; word--){
+        if (!arena->hist_bitmap[word]){
+            continue;
         }
-        if (metadata->prev->is_free){
-            hist_remove(metadata->prev);
+        int index = word * 64 + 63 - __builtin_clzll(arena->hist_bitmap[word]);
+        size_t largest = 0;
+        for (MallocMetadata* it = arena->hist[index]; it; it = freeLinks(it)->next2){
+            if (blockSize(it) > largest){
+                largest = blockSize(it);
+            }
         }
-        mergeNextBlock(metadata);
-        if ( mergeNextBlock(metadata->prev) ){
-            hist_insert(metadata->prev);
-        } else{
-            hist_insert(metadata);
+        return largest;
+    }
+    return 0;
+}
+
+void sheap_info(HeapInfo* info){
+    std::memset(info, 0, sizeof(*info));
+    info->bins = HIST_SIZE;
+    for (int index = 0; index < HIST_SIZE; index++){
+        info->bin_min_size[index] = hist_min_size(index);
+    }
+    for (int i = 0; i < MAX_ARENAS; i++){
+        Arena* arena = arenas[i];
+        if (!arena){
+            continue;
         }
-    }else{
-        metadata->is_free = true;
-        MallocMetadata* next_meta = metadata->next;
-        MallocMetadata* prev_meta = metadata->prev;
-        if(metadata == mmap_list_head){
-            mmap_list_head = next_meta;
+        LockGuard guard(&arena->lock);
+        info->free_blocks += arena->stats.free_blocks;
+        info->free_bytes += arena->stats.free_bytes;
+        info->trimmed_bytes += arena->stats.trimmed_bytes;
+        info->madvised_bytes += arena->stats.madvised_bytes;
+        info->heap_grows += arena->stats.grows;
+        info->heap_grows_saved += arena->stats.grows_saved;
+        info->heap_bytes += arena->list_head ? arena->top - (char*) arena->list_head : 0;
+        for (int index = 0; index < HIST_SIZE; index++){
+            info->bin_blocks[index] += arena->bin_blocks[index];
+            info->bin_bytes[index] += arena->bin_bytes[index];
         }
-        if(next_meta != nullptr){
-            next_meta->prev = prev_meta;
+        size_t largest = largestFreeBlock(arena);
+        if (largest > info->largest_free_block){
+            info->largest_free_block = largest;
         }
-        if(prev_meta != nullptr){
-            prev_meta->next = next_meta;
+        if (arena->list_tail && isFree(arena->list_tail)){
+            info->wilderness_bytes += blockSize(arena->list_tail);
         }
-        void* block_address = (void*)((char *) p - size_of_metadata);
-        munmap(block_address , metadata->size + size_of_metadata);
-    }
-}
-
-void* srealloc(void* oldp, size_t size){
-    if(size==0 || size>100000000){
-        return nullptr;
     }
-
-    if (oldp == nullptr) {
-        return smalloc(size);
+    if (info->free_bytes){
+        info->fragmentation = 1.0 - (double) info->largest_free_block / info->free_bytes;
     }
+    LockGuard guard(&mmap_lock);
+    info->mmap_blocks = mmap_blocks;
+    info->mmap_bytes = mmap_bytes;
+    info->mmap_cache_bytes = mmap_cache_bytes;
+    info->mmap_cache_hits = mmap_cache_hits;
+    info->mmap_cache_misses = mmap_cache_misses;
+}
 
-    MallocMetadata* metadata = (MallocMetadata*) (((char*) oldp) - size_of_metadata);
-    hist_remove(metadata);
-    if (metadata->size <= KILO * 128) {
-        if (size <= metadata->size ){
-            metadata->is_free = false;
-            //return oldp;
+void sheap_walk(HeapWalkCallback callback, void* arg){
+    HeapBlock block;
+    for (int i = 0; i < MAX_ARENAS; i++){
+        Arena* arena = arenas[i];
+        if (!arena){
+            continue;
         }
-        else if (!(metadata->next) && metadata->size < size) { // wilderness
-            size_t diff = size - metadata->size;
-            void* addr = sbrk(diff);
-            if (addr == (void*) -1) {
-                return nullptr;
-            }
-            metadata->size = size;
-        }
-        else if((metadata->prev) && (metadata->prev->is_free) && //Can combine the prev
-                ((metadata->prev->size + metadata->size + size_of_metadata) >= size) ){
-            hist_remove(metadata->prev);
-            metadata->prev->is_free = false;
-            metadata->prev->next = metadata->next;
-            metadata->prev->size = metadata->prev->size + size_of_metadata + metadata->size;
-            if (metadata->next){
-                metadata->next->prev = metadata->prev; //TODO: may be wrong
-            }
-            std::memmove(((char*)metadata->prev + size_of_metadata), ((char*)metadata + size_of_metadata), metadata->size);
-            metadata = metadata->prev;
-        }
-        else if ((metadata->next) && (metadata->next->is_free) && // Can combine the next
-                 ((metadata->next->size + metadata->size + size_of_metadata) >= size)){
-            hist_remove(metadata->next);
-            metadata->is_free = false;
-            metadata->size = metadata->next->size + metadata->size + size_of_metadata;
-            metadata->next = metadata->next->next;
-            if (metadata->next){
-                metadata->next->prev = metadata;
-            }
+        LockGuard guard(&arena->lock);
+        for (MallocMetadata* it = arena->list_head; it; it = nextBlock(arena, it)){
+            block.address = payloadOf(it);
+            block.size = blockSize(it);
+            block.kind = isFree(it) ? HEAP_BLOCK_FREE : HEAP_BLOCK_USED;
+            block.arena = i;
+            block.slot_size = block.slots_used = 0;
+            callback(&block, arg);
         }
-        else if ((metadata->next) && (metadata->next->is_free) && (metadata->prev) && (metadata->prev->is_free) // Can combine both
-        && ((metadata->prev->size + size_of_metadata + metadata->size + size_of_metadata + metadata->next->size) >= size) ){
-            hist_remove(metadata->prev);
-            hist_remove(metadata->next);
-            metadata->prev->is_free = false;
-            metadata->prev->size = metadata->prev->size + size_of_metadata + metadata->size + size_of_metadata + metadata->next->size;
-            std::memmove(((char*)metadata->prev + size_of_metadata), ((char*)metadata + size_of_metadata), metadata->size);
-            metadata->prev->next = metadata->next->next;
-            if (metadata->prev->next) {
-                metadata->prev->next->prev = metadata->prev;
-            }
-            metadata = metadata->prev;
-        } else{ // Need to allocate
-            void* addr = smalloc(size);
-            if (!addr){
-                return nullptr;
-            }
-            std::memmove(addr, (char*)metadata + size_of_metadata, size);
-            sfree((char*)metadata + size_of_metadata);
-            return addr;
+    }
+    {
+        LockGuard guard(&mmap_lock);
+        for (MallocMetadata* it = mmap_list_head; it; it = mmapLinks(it)->next){
+            block.address = payloadOf(it);
+            block.size = blockSize(it);
+            block.kind = HEAP_BLOCK_MMAP;
+            block.arena = 0;
+            block.slot_size = block.slots_used = 0;
+            callback(&block, arg);
         }
-
-        if (metadata->size >= size + size_of_metadata + 128){
-            splitBlock(metadata, size);
+    }
+    /******** The pages of all the arenas are interleaved in the region, so every slab lock is held ********/
+    for (int i = 0; i < MAX_ARENAS; i++){
+        if (arenas[i]){
+            pthread_mutex_lock(&arenas[i]->slab_lock);
         }
-
-        return (char *)metadata + size_of_metadata;
-    } else{
-        void* mmapp_address = smalloc(size);
-        if(mmapp_address == nullptr){
-            return nullptr;
+    }
+    pthread_mutex_lock(&slab_pool_lock);
+    for (char* page = slab_region; page && page < slab_top; page += SLAB_PAGE_SIZE){
+        SlabPage* slab = (SlabPage*) page;
+        if (!slab->slot_size){
+            continue;
         }
-        MallocMetadata* mmap_metadata = (MallocMetadata*)((char*)mmapp_address - size_of_metadata);
-        if(size < metadata->size){
-            std::memmove(mmapp_address, (char *)metadata + size_of_metadata, size);
-        }else{
-            std::memmove(mmapp_address, (char *)metadata + size_of_metadata, metadata->size);
+        block.address = page;
+        block.size = SLAB_PAGE_SIZE;
+        block.kind = HEAP_BLOCK_SLAB;
+        block.arena = slab->arena->index;
+        block.slot_size = slab->slot_size;
+        block.slots_used = slab->used;
+        callback(&block, arg);
+    }
+    pthread_mutex_unlock(&slab_pool_lock);
+    for (int i = MAX_ARENAS - 1; i >= 0; i--){
+        if (arenas[i]){
+            pthread_mutex_unlock(&arenas[i]->slab_lock);
         }
-        sfree(oldp);
-        return (char*)mmap_metadata + size_of_metadata;
     }
+}
 
-
+size_t _size_meta_data(){
+    return size_of_metadata ;
 }
 
 
-size_t _num_free_blocks(){
-    if(!list_head){
-        return 0;
-    }
-    MallocMetadata* it=list_head;
-    size_t num_free = 0;
-    while (it){
-        if(it->is_free){
-            num_free++;
+/************* PRELOAD *************/
+/* Built with -DMALLOC_PRELOAD this file is a drop-in replacement for the malloc family of the C library:
+
+	g++ -O2 -fPIC -shared -pthread -ftls-model=initial-exec -DMALLOC_PRELOAD malloc_3.cpp -o libsmalloc.so
+	LD_PRELOAD=./libsmalloc.so ./program
+
+ * The request limit of smalloc is lifted, and the C semantics smalloc does not have are added here:
+ * malloc(0) returns a block, failures set errno, calloc checks num*size for overflow. The allocator
+ * needs no initialization, every global has a static initializer, so the dynamic loader and libc can
+ * allocate before any constructor ran. The initial-exec TLS model keeps the thread caches from
+ * calling __tls_get_addr, which may allocate. The locks are taken around fork so the child never
+ * inherits one held by a thread it does not have. Everything but the malloc family and the functions
+ * of malloc_3.h is static, so the library exports no names another library could collide with.
+ *
+ * Parameters are read from the environment at load time: SMALLOC_<NAME>=<value> calls
+ * smallopt(M_<NAME>, value), for example SMALLOC_ARENAS=8 SMALLOC_TCACHE=1, and SMALLOC_TRACE=<file>
+ * records a trace of the whole run for "./bench replay".
+ */
+#ifdef MALLOC_PRELOAD
+#include <stdlib.h>
+
+/***
+ * Takes every lock of the allocator, in the order the allocator nests them: the arena locks, then the
+ * slab locks, which are never taken while an arena lock is held (sheap_walk takes all of them in this
+ * order), then the slab pool lock, which is taken under a slab lock, and the mmap lock last.
+ */
+static void forkPrepare(){
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&arenas_lock);
+    for (int i = 0; i < MAX_ARENAS; i++){
+        if (arenas[i]){
+            pthread_mutex_lock(&arenas[i]->lock);
         }
-        it=it->next;
     }
-    it = mmap_list_head;
-    while ( it ) {
-        if (it->is_free){
-            /******* We should not reach here, in our free function we
-             * remove munmaped blocks from the list ******/
-            assert(0);
+    for (int i = 0; i < MAX_ARENAS; i++){
+        if (arenas[i]){
+            pthread_mutex_lock(&arenas[i]->slab_lock);
         }
     }
-    return  num_free;
+    pthread_mutex_lock(&slab_pool_lock);
+    pthread_mutex_lock(&mmap_lock);
 }
 
-
-size_t _num_free_bytes(){
-    if(!list_head){
-        return 0;
+static void forkParent(){
+    pthread_mutex_unlock(&mmap_lock);
+    pthread_mutex_unlock(&slab_pool_lock);
+    for (int i = MAX_ARENAS - 1; i >= 0; i--){
+        if (arenas[i]){
+            pthread_mutex_unlock(&arenas[i]->slab_lock);
+        }
     }
-    MallocMetadata* it=list_head;
-    size_t num_free_bytes = 0;
-    while (it){
-        if(it->is_free){
-            num_free_bytes+=it->size;
+    for (int i = MAX_ARENAS - 1; i >= 0; i--){
+        if (arenas[i]){
+            pthread_mutex_unlock(&arenas[i]->lock);
         }
-        it=it->next;
     }
-    it = mmap_list_head;
-    while ( it ) {
-        if (it->is_free){
-            /******* We should not reach here, in our free function we
-             * remove munmaped blocks from the list ******/
-            assert(0);
+    pthread_mutex_unlock(&arenas_lock);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/***
+ * The child has only the thread that forked, which holds every lock, so they are simply reset. A trace
+ * stops in the child: its buffers hold copies of records the parent writes itself, so they are dropped,
+ * and the trace file is closed without writing.
+ */
+static void forkChild(){
+    for (TraceBuffer* buffer = trace_buffers; buffer; buffer = buffer->next){
+        pthread_mutex_init(&buffer->lock, nullptr);
+        buffer->count = 0;
+        buffer->in_use = buffer == trace_buffer;
+    }
+    if (trace_fd >= 0){
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    tracing = false;
+    pthread_mutex_init(&mmap_lock, nullptr);
+    pthread_mutex_init(&slab_pool_lock, nullptr);
+    for (int i = 0; i < MAX_ARENAS; i++){
+        if (arenas[i]){
+            pthread_mutex_init(&arenas[i]->slab_lock, nullptr);
+            pthread_mutex_init(&arenas[i]->lock, nullptr);
         }
-        it = it->next;
     }
-    return num_free_bytes ;
+    pthread_mutex_init(&arenas_lock, nullptr);
+    pthread_mutex_init(&trace_lock, nullptr);
 }
 
-size_t _num_allocated_blocks(){
-    if(!list_head){
-        return 0;
+struct PreloadOption {
+    const char* name;
+    int param;
+};
+
+static const PreloadOption preload_options[] = {
+    {"SMALLOC_TCACHE", M_TCACHE},
+    {"SMALLOC_ARENAS", M_ARENAS},
+    {"SMALLOC_ARENA_PER_CPU", M_ARENA_PER_CPU},
+    {"SMALLOC_SLAB_MAX", M_SLAB_MAX},
+    {"SMALLOC_TRIM_THRESHOLD", M_TRIM_THRESHOLD},
+    {"SMALLOC_MADVISE_THRESHOLD", M_MADVISE_THRESHOLD},
+    {"SMALLOC_MMAP_CACHE_MAX", M_MMAP_CACHE_MAX},
+    {"SMALLOC_HUGEPAGES", M_HUGEPAGES},
+    {"SMALLOC_FASTBIN_MAX", M_FASTBIN_MAX},
+    {"SMALLOC_HEAP_GROWTH", M_HEAP_GROWTH},
+};
+
+__attribute__((constructor)) static void preloadInit(){
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+    for (const PreloadOption& option : preload_options){
+        const char* value = getenv(option.name);
+        if (value){
+            smallopt(option.param, atoi(value));
+        }
     }
-    MallocMetadata* it=list_head;
-    size_t num_alo = 0;
-    while (it){
-        num_alo++;
-        it=it->next;
+    const char* trace = getenv("SMALLOC_TRACE");
+    if (trace){
+        smalloc_trace_start(trace);
     }
+}
 
-    it = mmap_list_head;
-    while ( it ) {
-        num_alo++;
-        it = it->next;
+__attribute__((destructor)) static void preloadFini(){
+    if (tracing){
+        smalloc_trace_stop();
     }
-    return  num_alo ;
 }
 
+extern "C" {
 
-size_t _num_allocated_bytes(){
-    if(!list_head){
-        return 0;
+void* malloc(size_t size){
+    void* p = smalloc(size ? size : 1);
+    if (!p){
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* p){
+    sfree(p);
+}
+
+void* calloc(size_t num, size_t size){
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total)){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void* p = total ? scalloc(num, size) : scalloc(1, 1);
+    if (!p){
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* realloc(void* oldp, size_t size){
+    if (oldp && !size){
+        sfree(oldp);
+        return nullptr;
     }
-    MallocMetadata* it=list_head;
-    size_t num_alo_bytes = 0;
-    while (it){
-        num_alo_bytes+=it->size;
-        it=it->next;
+    void* p = srealloc(oldp, size ? size : 1);
+    if (!p){
+        errno = ENOMEM;
     }
+    return p;
+}
 
-    it = mmap_list_head;
-    while ( it ) {
-        num_alo_bytes += it->size;
-        it = it->next;
+void* memalign(size_t alignment, size_t size){
+    if (!alignment || (alignment & (alignment - 1))){
+        errno = EINVAL;
+        return nullptr;
+    }
+    void* p = smemalign(alignment, size ? size : 1);
+    if (!p){
+        errno = ENOMEM;
     }
-    return  num_alo_bytes ;
+    return p;
 }
 
-size_t _num_meta_data_bytes(){
-    return _num_allocated_blocks()*size_of_metadata ;
+void* aligned_alloc(size_t alignment, size_t size){
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size){
+    return sposix_memalign(memptr, alignment, size ? size : 1);
 }
 
+void* valloc(size_t size){
+    return memalign(OS_PAGE_SIZE, size);
+}
 
+void* pvalloc(size_t size){
+    return memalign(OS_PAGE_SIZE, (size + OS_PAGE_SIZE - 1) & ~(size_t) (OS_PAGE_SIZE - 1));
+}
 
-size_t _size_meta_data(){
-    return size_of_metadata ;
+void free_sized(void* p, size_t size){
+    sfree_sized(p, size);
+}
+
+size_t malloc_usable_size(void* p){
+    return susable_size(p);
 }
 
+}
+#endif
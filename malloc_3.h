@@ -0,0 +1,235 @@
+#ifndef MALLOC_3_H
+#define MALLOC_3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+
+/***
+ * Same as sfree, for a caller that knows the size of the block: the size passed to the smalloc,
+ * scalloc (num*size), srealloc or smemalign call that returned it, or anything up to susable_size.
+ * A small block goes straight to the thread cache or its slab without reading any header.
+ */
+void sfree_sized(void* p, size_t size);
+
+/***
+ * @return How many bytes the block at p can hold, at least the size it was allocated with. The caller
+ * may use all of them, and srealloc to at most that many bytes returns p without copying.
+ */
+size_t susable_size(void* p);
+
+/***
+ * Allocates count blocks of the same size in one call. Small blocks are taken from their slab under a
+ * single lock, and the others are carved out of one free region or heap extension, so the bins are
+ * searched once per batch instead of once per block.
+ *
+ * @param out: Receives the blocks.
+ * @return How many blocks were stored in out, less than count only if memory ran out.
+ */
+size_t smalloc_batch(size_t size, size_t count, void** out);
+
+/***
+ * Frees count blocks, like calling sfree on each of them. The array is sorted by address, so blocks
+ * that lie back to back are merged and freed as one, and each lock is taken once per group of
+ * blocks it covers. NULL entries are ignored.
+ */
+void sfree_batch(void** ptrs, size_t count);
+
+/* A region allocates objects that are all released together, by sregion_reset or sregion_destroy. It
+ * bumps a pointer through chunks of chunk_size bytes that it gets from smalloc, so objects have no
+ * header and cost a few instructions; sregion_reset keeps the chunks for reuse and takes constant time,
+ * plus one sfree per object larger than a quarter of a chunk. A region is not thread safe. */
+struct SRegion;
+
+/***
+ * @param chunk_size: Bytes per chunk, 0 for the default of about 64 KiB.
+ * @return The region, or NULL if it could not be allocated.
+ */
+SRegion* sregion_create(size_t chunk_size);
+
+/***
+ * @return A 16 bytes aligned object, or NULL for a size of 0 or if the memory ran out.
+ */
+void* sregion_alloc(SRegion* region, size_t size);
+
+/***
+ * Releases every object of the region at once. The chunks stay with the region.
+ */
+void sregion_reset(SRegion* region);
+
+/***
+ * Releases every object and gives the chunks back to the heap.
+ */
+void sregion_destroy(SRegion* region);
+
+/***
+ * Allocates a block whose address is a multiple of alignment, in the spirit of memalign(3). The block is
+ * freed with sfree and resized with srealloc like any other; srealloc may move it to a block that is
+ * only 16 bytes aligned. Every block of smalloc, scalloc and srealloc is 16 bytes aligned.
+ *
+ * @param alignment: A power of two.
+ * @return The block, or NULL if alignment is not a power of two or the block could not be allocated.
+ */
+void* smemalign(size_t alignment, size_t size);
+
+/***
+ * Same as smemalign, like aligned_alloc(3).
+ */
+void* saligned_alloc(size_t alignment, size_t size);
+
+/***
+ * Stores a block aligned like smemalign in *memptr, like posix_memalign(3). A size of 0 stores NULL.
+ *
+ * @param alignment: A power of two multiple of sizeof(void*).
+ * @return 0 on success, EINVAL for a bad alignment, ENOMEM if the block could not be allocated.
+ */
+int sposix_memalign(void** memptr, size_t alignment, size_t size);
+
+/***
+ * Tunes the allocator, in the spirit of mallopt(3).
+ *
+ * @param param: One of the M_* parameters below.
+ * @param value: The new value of the parameter.
+ * @return 1 on success, 0 if the parameter is unknown.
+ */
+int smallopt(int param, int value);
+
+/* Non zero turns on the per thread cache of small blocks. Turning it off flushes the cache of the
+ * calling thread only, so change it before starting other threads. Off by default. */
+#define M_TCACHE 1
+/* Number of arenas (1 to 64) threads are spread over. Every arena is a heap in an address range of its
+ * own, reserved with mmap and committed as the heap grows; arena 0, the main one, reserves up to 64 GiB,
+ * the others 256 MiB. Every arena also has slabs of its own. A thread keeps the arena it got on its first
+ * allocation. Default 1. */
+#define M_ARENAS 2
+/* Non zero picks the arena on every allocation by the CPU the thread runs on (sched_getcpu) instead
+ * of assigning arenas to threads round robin. */
+#define M_ARENA_PER_CPU 3
+/* Largest request (0 to 256 bytes) served from slabs, pages of equal slots without per block headers.
+ * 0 turns the slabs off. Default 256. */
+#define M_SLAB_MAX 4
+/* A free block at the top of a heap of at least this many bytes more than M_HEAP_GROWTH is trimmed
+ * down to one growth step past a page boundary: the pages past it are decommitted, and the pages of the
+ * step left are dropped with madvise(MADV_DONTNEED). 0 never trims. Default 128 KiB. */
+#define M_TRIM_THRESHOLD 5
+/* A free block inside a heap of at least this many bytes gives its whole pages back to the OS with
+ * madvise(MADV_DONTNEED). 0 never does. Default 256 KiB. */
+#define M_MADVISE_THRESHOLD 6
+/* Most bytes of freed large (mmap'ed) blocks kept mapped for reuse by later large allocations. The
+ * regions cached the longest ago are unmapped first. 0 unmaps every block as it is freed.
+ * Default 32 MiB. */
+#define M_MMAP_CACHE_MAX 7
+/* Huge page mode, off (0) by default. In mode 1 large blocks of 2 MiB and more get a region of their
+ * own, 2 MiB aligned and rounded, advised with MADV_HUGEPAGE; the heaps, whose ranges are 256 MiB
+ * aligned, are advised too as they grow from then on. Mode 2 maps large blocks with MAP_HUGETLB first
+ * and falls back to mode 1 when the system has no huge pages reserved. */
+#define M_HUGEPAGES 8
+/* Largest block (0 to 1008 bytes) that sfree keeps in the arena's fast bins, lists of blocks of one exact
+ * size that are not coalesced until a request misses or they grow to 64 KiB, so a free followed by an
+ * allocation of the same size skips the merging and the bins. Blocks in the fast bins count as
+ * allocated. 0, the default, coalesces every block when it is freed. */
+#define M_FASTBIN_MAX 9
+/* Smallest step in bytes the heaps grow by when no free block fits. The step doubles with every growth
+ * up to 16 MiB, what a request does not need stays free at the top of the heap, and trimming keeps one
+ * step of it. 0 grows by exactly what is missing. Default 128 KiB. */
+#define M_HEAP_GROWTH 10
+
+/***
+ * Starts recording every smalloc, scalloc, srealloc, smemalign and sfree call, from all threads, to a
+ * binary trace: TRACE_MAGIC followed by TraceRecords. bench.cpp replays such a trace with "./bench replay <file>".
+ *
+ * @param path: The trace file, created or truncated.
+ * @return 1 on success, 0 if the file could not be created or a trace is already running.
+ */
+int smalloc_trace_start(const char* path);
+
+/***
+ * Writes out what is left of the trace and closes it.
+ */
+void smalloc_trace_stop();
+
+#define TRACE_MAGIC "SMTRACE2"
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_FREE 4
+#define TRACE_MEMALIGN 5
+
+struct TraceRecord {
+    uint64_t time;          // CLOCK_MONOTONIC nanoseconds
+    uint64_t address;       // the block returned, or the block freed for TRACE_FREE
+    uint64_t old_address;   // the block passed to srealloc, or the alignment for TRACE_MEMALIGN
+    uint64_t size;          // the size requested (num*size for scalloc)
+    uint16_t thread;        // a small id of the calling thread, from 1
+    uint8_t op;             // TRACE_*
+    uint8_t reserved[5];
+};
+
+#define HEAP_INFO_BINS 512 // room for the bins of any placement policy, see HeapInfo::bins
+
+/* A snapshot of the free memory of the arenas, see sheap_info. Free slab slots and blocks sitting in
+ * thread caches count as allocated, like in the _num_* functions. */
+struct HeapInfo {
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free_block;
+    double fragmentation;       // external fragmentation: 1 - largest_free_block / free_bytes
+    size_t wilderness_bytes;    // free blocks at the top of the arenas
+    size_t mmap_blocks;
+    size_t mmap_bytes;
+    size_t mmap_cache_bytes;    // kept mapped for reuse, see M_MMAP_CACHE_MAX
+    size_t mmap_cache_hits;     // large allocations served from the cache so far
+    size_t mmap_cache_misses;   // large allocations that had to mmap
+    size_t trimmed_bytes;       // returned to the OS so far by trimming the top of the heaps
+    size_t madvised_bytes;      // passed to madvise so far, a page is counted again every time it is
+    size_t heap_grows;          // times a heap grew so far (at most an mprotect call each)
+    size_t heap_grows_saved;    // allocations a growth step served that would have grown the heap
+    size_t heap_bytes;          // the heaps of the arenas, from their first block to their top
+    size_t bins;                // bins the build's placement policy has, the ones past them are zero
+    size_t bin_min_size[HEAP_INFO_BINS];   // free blocks of bin i are at least this large, SIZE_MAX if none can be
+    size_t bin_blocks[HEAP_INFO_BINS];
+    size_t bin_bytes[HEAP_INFO_BINS];
+};
+
+/***
+ * Fills a HeapInfo. Costs a few hundred additions per arena plus a scan of the highest non empty bin,
+ * independent of the size of the heap, so it can be polled on a live process. Each arena is read under
+ * its own lock, so the snapshot is not atomic across arenas.
+ */
+void sheap_info(HeapInfo* info);
+
+#define HEAP_BLOCK_USED 1
+#define HEAP_BLOCK_FREE 2
+#define HEAP_BLOCK_MMAP 3
+#define HEAP_BLOCK_SLAB 4
+
+struct HeapBlock {
+    void* address;          // the payload, or the page for HEAP_BLOCK_SLAB
+    size_t size;            // the payload size, or the page size for HEAP_BLOCK_SLAB
+    uint8_t kind;           // HEAP_BLOCK_*
+    uint8_t arena;          // the arena of USED and FREE blocks and of SLAB pages
+    uint32_t slot_size;     // HEAP_BLOCK_SLAB only
+    uint32_t slots_used;    // HEAP_BLOCK_SLAB only
+};
+
+typedef void (*HeapWalkCallback)(const HeapBlock* block, void* arg);
+
+/***
+ * Calls callback for every block of every arena in address order, then every mmap'ed block, then every
+ * slab page in use. The callback runs with the lock of what it is shown held, so it must not call the
+ * allocator. This walks the whole heap: it is meant for dumps, not for polling.
+ */
+void sheap_walk(HeapWalkCallback callback, void* arg);
+
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+
+#endif //MALLOC_3_H
@@ -0,0 +1,1199 @@
+/*
+HOW TO RUN?
+	g++ -O1 -pthread -DMALLOC_DEBUG test_malloc_3.cpp malloc_3.cpp -o test_malloc_3
+	./test_malloc_3
+
+Functional tests of malloc_3. Every test runs in a forked child (same trick as
+main.cpp) so it starts from a clean heap, and a failed assert only fails that
+test. Build with -DMALLOC_DEBUG: every _num_* query then walks the arenas and
+the mmap list and asserts that the running counters match them, so the tests
+check the bookkeeping of every path they take along with the data.
+
+The exit status is the number of failed tests.
+ */
+
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <vector>
+#include "malloc_3.h"
+
+typedef unsigned char byte;
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+/* Payload bytes handed out and not freed yet. Merging and trimming change the
+ * block counts but not this, so it comes back to where a test started once
+ * everything the test allocated is freed (with no thread cache or fast bins,
+ * whose blocks count as allocated). Also runs the MALLOC_DEBUG checks. */
+size_t live_bytes() {
+    return _num_allocated_bytes() - _num_free_bytes();
+}
+
+bool is_aligned(void* p, size_t alignment) {
+    return (uintptr_t) p % alignment == 0;
+}
+
+/* Fills a block with a pattern that depends on its seed and on the offset. */
+void fill(void* p, size_t size, byte seed) {
+    byte* b = static_cast<byte*>(p);
+    for (size_t i = 0; i < size; ++i)
+        b[i] = (byte) (seed + i * 7);
+}
+
+bool check(void* p, size_t size, byte seed) {
+    byte* b = static_cast<byte*>(p);
+    for (size_t i = 0; i < size; ++i)
+        if (b[i] != (byte) (seed + i * 7))
+            return false;
+    return true;
+}
+
+bool is_zero(void* p, size_t size) {
+    byte* b = static_cast<byte*>(p);
+    for (size_t i = 0; i < size; ++i)
+        if (b[i])
+            return false;
+    return true;
+}
+
+/* What sheap_walk reports for the block at p, or for the slab page that
+ * holds it; kind is 0 if it finds neither */
+struct Query {
+    byte* p;
+    HeapBlock found;
+};
+
+void find_block(const HeapBlock* block, void* arg) {
+    Query* query = static_cast<Query*>(arg);
+    byte* start = static_cast<byte*>(block->address);
+    if (block->kind == HEAP_BLOCK_SLAB ? query->p >= start && query->p < start + block->size
+                                       : query->p == start)
+        query->found = *block;
+}
+
+HeapBlock find(void* p) {
+    Query query = {static_cast<byte*>(p), {}};
+    sheap_walk(find_block, &query);
+    return query.found;
+}
+
+/* The arena of a heap block, -1 if p is not one */
+int arena_of(void* p) {
+    HeapBlock block = find(p);
+    return block.kind == HEAP_BLOCK_USED ? block.arena : -1;
+}
+
+/* Slab slots (up to 256 bytes), heap blocks and mmap'ed blocks (from 128 KiB) */
+const size_t SIZES[] = {1, 16, 24, 100, 256, 257, 1000, 4096, 50000,
+                        128 * 1024, 300 * 1024, 3 * 1024 * 1024};
+const int SIZE_COUNT = sizeof(SIZES) / sizeof(SIZES[0]);
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_alignment() {
+    size_t initial = live_bytes();
+    void* p[SIZE_COUNT];
+
+    /* Every ordinary block is 16 bytes aligned and can hold what was asked */
+    for (int i = 0; i < SIZE_COUNT; ++i) {
+        p[i] = smalloc(SIZES[i]);
+        assert(p[i] && is_aligned(p[i], 16));
+        assert(susable_size(p[i]) >= SIZES[i]);
+        fill(p[i], susable_size(p[i]), i);
+    }
+    for (int i = 0; i < SIZE_COUNT; ++i) {
+        assert(check(p[i], susable_size(p[i]), i));
+        sfree(p[i]);
+    }
+    assert(live_bytes() == initial);
+
+    /* smemalign, from below the slot size to past the mmap threshold */
+    const size_t ALIGNMENTS[] = {16, 32, 64, 256, 4096, 65536, 1024 * 1024};
+    for (size_t alignment : ALIGNMENTS) {
+        for (int i = 0; i < SIZE_COUNT; ++i) {
+            p[i] = smemalign(alignment, SIZES[i]);
+            assert(p[i] && is_aligned(p[i], alignment));
+            assert(susable_size(p[i]) >= SIZES[i]);
+            fill(p[i], SIZES[i], i);
+        }
+        for (int i = 0; i < SIZE_COUNT; ++i) {
+            assert(check(p[i], SIZES[i], i));
+            sfree(p[i]);
+        }
+    }
+    assert(live_bytes() == initial);
+
+    /* An aligned block can be resized like any other */
+    void* q = smemalign(4096, 100);
+    fill(q, 100, 3);
+    q = srealloc(q, 20000);
+    assert(q && check(q, 100, 3));
+    sfree(q);
+
+    assert(!smemalign(24, 100));
+    assert(!smemalign(0, 100));
+    assert((q = saligned_alloc(512, 10)) && is_aligned(q, 512));
+    sfree(q);
+    assert(sposix_memalign(&q, 4, 100) == EINVAL);
+    assert(sposix_memalign(&q, 48, 100) == EINVAL);
+    assert(sposix_memalign(&q, 128, 0) == 0 && !q);
+    assert(sposix_memalign(&q, 128, 100) == 0 && is_aligned(q, 128));
+    sfree(q);
+    assert(live_bytes() == initial);
+}
+
+void test_calloc_zero() {
+    /* Dirty every kind of block first, so scalloc gets memory that was used */
+    void* p[SIZE_COUNT];
+    for (int i = 0; i < SIZE_COUNT; ++i) {
+        p[i] = smalloc(SIZES[i]);
+        memset(p[i], 0xAB, SIZES[i]);
+    }
+    for (int i = 0; i < SIZE_COUNT; ++i)
+        sfree(p[i]);
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < SIZE_COUNT; ++i) {
+            p[i] = scalloc(SIZES[i], 1);
+            assert(p[i] && is_zero(p[i], SIZES[i]));
+            memset(p[i], 0xCD, SIZES[i]);
+        }
+        for (int i = 0; i < SIZE_COUNT; ++i)
+            sfree(p[i]);
+    }
+
+    /* A large free block inside the heap, split by scalloc, and the heap
+     * grown and trimmed under it: every path that knows memory reads as
+     * zeros and skips the memset */
+    void* a = smalloc(100000);
+    void* guard = smalloc(1000);
+    memset(a, 0xEE, 100000);
+    sfree(a);
+    void* b = scalloc(1000, 30);
+    assert(is_zero(b, 30000));
+    void* c = scalloc(3000, 20);
+    assert(is_zero(c, 60000));
+    void* d = scalloc(1, 500000 - 16);
+    assert(is_zero(d, 500000 - 16));
+    sfree(b);
+    sfree(c);
+    sfree(d);
+    sfree(guard);
+    void* e = scalloc(100, 100);
+    assert(is_zero(e, 10000));
+    sfree(e);
+
+    assert(!scalloc(SIZE_MAX / 2, 4));
+    assert(!scalloc(0, 10));
+}
+
+void test_realloc_data() {
+    size_t initial = live_bytes();
+
+    /* A free block before it and a used one after it: slides back.
+     * It goes first, while the heap has no holes for f to come from */
+    byte* f = static_cast<byte*>(smalloc(2000));
+    byte* g = static_cast<byte*>(smalloc(1000));
+    void* h = smalloc(1000);
+    fill(g, 1000, 70);
+    sfree(f);
+    g = static_cast<byte*>(srealloc(g, 2500));
+    assert(g == f && check(g, 1000, 70));
+    sfree(g);
+    sfree(h);
+
+    /* Grow one block through the slabs, the heap and mmap, and back down */
+    const size_t STEPS[] = {10, 100, 256, 300, 5000, 60000, 200000, 1000000,
+                            150000, 4000, 200, 8};
+    void* p = smalloc(STEPS[0]);
+    fill(p, STEPS[0], 1);
+    size_t size = STEPS[0];
+    for (size_t step : STEPS) {
+        p = srealloc(p, step);
+        assert(p && is_aligned(p, 16));
+        assert(check(p, step < size ? step : size, 1));
+        fill(p, step, 1);
+        size = step;
+    }
+    sfree(p);
+    assert(live_bytes() == initial);
+
+    /* A free block after it (grows in place), a used one (moves) */
+    byte* a = static_cast<byte*>(smalloc(1000));
+    byte* b = static_cast<byte*>(smalloc(1000));
+    byte* c = static_cast<byte*>(smalloc(1000));
+    byte* d = static_cast<byte*>(smalloc(1000));
+    fill(a, 1000, 10);
+    fill(b, 1000, 20);
+    fill(c, 1000, 30);
+    fill(d, 1000, 40);
+    sfree(c);
+    b = static_cast<byte*>(srealloc(b, 1800));
+    assert(b && check(b, 1000, 20));
+    fill(b, 1800, 21);
+    a = static_cast<byte*>(srealloc(a, 3000));
+    assert(a && check(a, 1000, 10));
+    fill(a, 3000, 11);
+    d = static_cast<byte*>(srealloc(d, 2500));
+    assert(d && check(d, 1000, 40));
+    assert(check(a, 3000, 11) && check(b, 1800, 21));
+
+    /* Shrinking keeps the prefix, and the tail it gives back is reusable */
+    b = static_cast<byte*>(srealloc(b, 100));
+    assert(b && check(b, 100, 21));
+    void* e = smalloc(1000);
+    fill(e, 1000, 50);
+    assert(check(b, 100, 21) && check(a, 3000, 11));
+
+    /* Growing at the top of the heap extends it in place */
+    void* top = smalloc(64 * 1024 - 100);
+    fill(top, 64 * 1024 - 100, 60);
+    for (size_t grow = 64 * 1024; grow < 120 * 1024; grow += 4096) {
+        top = srealloc(top, grow);
+        assert(top && check(top, 64 * 1024 - 100, 60));
+    }
+
+    /* Failures leave the block alone */
+    assert(!srealloc(b, 0));
+    assert(check(b, 100, 21));
+    assert((p = srealloc(nullptr, 40)));
+    sfree(p);
+
+    sfree(a);
+    sfree(b);
+    sfree(d);
+    sfree(e);
+    sfree(top);
+    assert(live_bytes() == initial);
+}
+
+void test_batch() {
+    size_t initial = live_bytes();
+    const size_t BATCH_SIZES[] = {48, 400, 5000, 200000};
+    const int COUNT = 100;
+    void* blocks[COUNT * 4 + 2];
+    int total = 0;
+
+    for (size_t size : BATCH_SIZES) {
+        int count = size >= 128 * 1024 ? 3 : COUNT;
+        size_t done = smalloc_batch(size, count, blocks + total);
+        assert(done == (size_t) count);
+        for (int i = 0; i < count; ++i) {
+            void* p = blocks[total + i];
+            assert(p && is_aligned(p, 16) && susable_size(p) >= size);
+            for (int j = 0; j < total + i; ++j)
+                assert(blocks[j] != p);
+            fill(p, size, total + i);
+        }
+        total += count;
+    }
+    int i = 0;
+    for (size_t size : BATCH_SIZES)
+        for (int k = 0; k < (size >= 128 * 1024 ? 3 : COUNT); ++k, ++i)
+            assert(check(blocks[i], size, i));
+    assert(smalloc_batch(0, 10, blocks + total) == 0);
+
+    /* sfree_batch takes any order and skips NULL */
+    blocks[total++] = nullptr;
+    for (int k = 0; k < total / 2; ++k) {
+        void* t = blocks[k];
+        blocks[k] = blocks[total - 1 - k];
+        blocks[total - 1 - k] = t;
+    }
+    sfree_batch(blocks, total);
+    assert(live_bytes() == initial);
+
+    /* Around the mmap threshold: sizes that round up to it get one block per
+     * call from the heap, or mmap'ed ones */
+    const size_t EDGE_SIZES[] = {128 * 1024 - 32, 128 * 1024 - 16 - 15,
+                                 128 * 1024 - 1, 128 * 1024};
+    for (size_t size : EDGE_SIZES) {
+        void* edge[3];
+        assert(smalloc_batch(size, 3, edge) == 3);
+        for (int k = 0; k < 3; ++k) {
+            assert(edge[k] && susable_size(edge[k]) >= size);
+            fill(edge[k], size, k);
+        }
+        for (int k = 0; k < 3; ++k)
+            assert(check(edge[k], size, k));
+        sfree_batch(edge, 3);
+    }
+    assert(live_bytes() == initial);
+
+    /* A run of neighbours freed by sfree_batch merges into one free block */
+    void* run[8];
+    assert(smalloc_batch(1024, 8, run) == 8);
+    void* guard = smalloc(1024);
+    size_t free_blocks = _num_free_blocks();
+    size_t free_bytes = _num_free_bytes();
+    sfree_batch(run, 8);
+    size_t merged = 8 * 1024 + 7 * _size_meta_data();
+    assert(_num_free_blocks() == free_blocks + 1);
+    assert(_num_free_bytes() == free_bytes + merged);
+    HeapBlock block = find(run[0]);
+    assert(block.kind == HEAP_BLOCK_FREE && block.size == merged);
+    sfree(guard);
+    assert(live_bytes() == initial);
+}
+
+void test_region() {
+    size_t initial = live_bytes();
+    SRegion* region = sregion_create(0);
+    assert(region);
+    const int OBJECTS = 5000;
+    void* objects[OBJECTS];
+
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < OBJECTS; ++i) {
+            size_t size = 1 + i % 200;
+            objects[i] = sregion_alloc(region, size);
+            assert(objects[i] && is_aligned(objects[i], 16));
+            fill(objects[i], size, i + round);
+        }
+        /* Larger than a quarter of a chunk: smalloc'ed on its own */
+        void* large = sregion_alloc(region, 40000);
+        assert(large && is_aligned(large, 16));
+        fill(large, 40000, 9);
+        for (int i = 0; i < OBJECTS; ++i)
+            assert(check(objects[i], 1 + i % 200, i + round));
+        assert(check(large, 40000, 9));
+        assert(!sregion_alloc(region, 0));
+        sregion_reset(region);
+    }
+    /* The chunks stay with the region after a reset, until it is destroyed */
+    assert(live_bytes() > initial);
+    sregion_destroy(region);
+    sregion_destroy(nullptr);
+    assert(live_bytes() == initial);
+
+    region = sregion_create(4096);
+    for (int i = 0; i < 100; ++i)
+        fill(sregion_alloc(region, 100), 100, i);
+    sregion_destroy(region);
+    assert(live_bytes() == initial);
+}
+
+void test_fastbins() {
+    /* Small blocks from the heap, not from the slabs */
+    assert(smallopt(M_SLAB_MAX, 0));
+    assert(smallopt(M_FASTBIN_MAX, 1008));
+    assert(!smallopt(M_FASTBIN_MAX, 2000));
+    size_t initial = live_bytes();
+
+    /* A freed block is handed out again for the same size, without merging
+     * with its free neighbour */
+    void* a = smalloc(64);
+    void* b = smalloc(64);
+    void* c = smalloc(64);
+    fill(a, 64, 1);
+    fill(c, 64, 3);
+    sfree(b);
+    sfree(a);
+    void* d = smalloc(64);
+    assert(d == a);
+    void* e = smalloc(64);
+    assert(e == b);
+    assert(check(c, 64, 3));
+
+    /* Fill the fast bins with many sizes, then miss so they are merged */
+    const int BLOCKS = 2000;
+    void* blocks[BLOCKS];
+    for (int i = 0; i < BLOCKS; ++i) {
+        blocks[i] = smalloc(16 + i % 60 * 16);
+        fill(blocks[i], 16 + i % 60 * 16, i);
+    }
+    for (int i = 0; i < BLOCKS; i += 2)
+        sfree(blocks[i]);
+    for (int i = 1; i < BLOCKS; i += 2)
+        assert(check(blocks[i], 16 + i % 60 * 16, i));
+    void* large = smalloc(50000);
+    fill(large, 50000, 7);
+    for (int i = 1; i < BLOCKS; i += 2)
+        sfree(blocks[i]);
+    sfree(large);
+    sfree(c);
+    sfree(d);
+    sfree(e);
+
+    /* Turning them off merges what they hold, so nothing counts as live */
+    assert(smallopt(M_FASTBIN_MAX, 0));
+    assert(live_bytes() == initial);
+}
+
+void* tcache_worker(void* arg) {
+    /* Heap blocks of this thread's arena; the ones its cache still holds
+     * go back when it exits */
+    void** blocks = static_cast<void**>(arg);
+    for (int i = 0; i < 40; ++i) {
+        blocks[i] = smalloc(64);
+        assert(find(blocks[i]).kind == HEAP_BLOCK_USED && find(blocks[i]).arena == 1);
+    }
+    return nullptr;
+}
+
+void test_tcache() {
+    assert(smallopt(M_ARENAS, 2));
+    assert(smallopt(M_TCACHE, 1));
+    size_t initial = live_bytes();
+
+    /* A freed block is the next one handed out for its 16 bytes class, and
+     * it still counts as allocated while it is cached */
+    void* p = smalloc(100);
+    size_t live = live_bytes();
+    sfree(p);
+    assert(live_bytes() == live);
+    assert(smalloc(100) == p);
+    sfree(p);
+    assert(smalloc(112) == p);
+    sfree(p);
+    assert(smalloc(97) == p);
+    sfree(p);
+    void* large = smalloc(2000);  // past the last class
+    sfree(large);
+    assert(live_bytes() == live);
+
+    /* One magazine filled with slab slots of this arena and heap blocks of
+     * another, in turns, so every flush switches between them */
+    void* heap[40];
+    void* slots[40];
+    assert(smallopt(M_SLAB_MAX, 0));
+    pthread_t thread;
+    assert(!pthread_create(&thread, nullptr, tcache_worker, heap));
+    pthread_join(thread, nullptr);
+    assert(smallopt(M_SLAB_MAX, 256));
+    for (int i = 0; i < 40; ++i) {
+        slots[i] = smalloc(64);
+        assert(find(slots[i]).kind == HEAP_BLOCK_SLAB);
+        fill(heap[i], 64, i);
+        fill(slots[i], 64, i + 100);
+    }
+    for (int i = 0; i < 40; ++i) {
+        assert(check(heap[i], 64, i) && check(slots[i], 64, i + 100));
+        sfree(heap[i]);
+        sfree(slots[i]);
+    }
+
+    /* Turning the cache off flushes it */
+    assert(smallopt(M_TCACHE, 0));
+    assert(live_bytes() == initial);
+}
+
+void* trace_worker(void*) {
+    /* More records than one buffer holds */
+    for (int i = 0; i < 1500; ++i)
+        sfree(smalloc(1 + i % 500));
+    return nullptr;
+}
+
+void test_trace() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_malloc_3_trace_%d", (int) getpid());
+    assert(smalloc_trace_start(path));
+    assert(!smalloc_trace_start(path));
+
+    void* a = smalloc(100);
+    void* b = scalloc(10, 30);
+    void* c = srealloc(a, 5000);
+    void* d = smemalign(4096, 300);
+    sfree(b);
+    sfree(c);
+    sfree_sized(d, 300);
+    sfree(nullptr);
+    void* batch[3];
+    assert(smalloc_batch(48, 3, batch) == 3);
+    sfree_batch(batch, 3);
+    pthread_t thread;
+    assert(!pthread_create(&thread, nullptr, trace_worker, nullptr));
+    pthread_join(thread, nullptr);
+    smalloc_trace_stop();
+    sfree(smalloc(10));  // after the stop, not recorded
+
+    /* The records of the main thread, in the order of its calls; the
+     * frees of the batch follow them */
+    const TraceRecord expected[] = {
+        {0, (uintptr_t) a, 0, 100, 1, TRACE_MALLOC, {}},
+        {0, (uintptr_t) b, 0, 300, 1, TRACE_CALLOC, {}},
+        {0, (uintptr_t) c, (uintptr_t) a, 5000, 1, TRACE_REALLOC, {}},
+        {0, (uintptr_t) d, 4096, 300, 1, TRACE_MEMALIGN, {}},
+        {0, (uintptr_t) b, 0, 0, 1, TRACE_FREE, {}},
+        {0, (uintptr_t) c, 0, 0, 1, TRACE_FREE, {}},
+        {0, (uintptr_t) d, 0, 0, 1, TRACE_FREE, {}},
+        {0, (uintptr_t) batch[0], 0, 48, 1, TRACE_MALLOC, {}},
+        {0, (uintptr_t) batch[1], 0, 48, 1, TRACE_MALLOC, {}},
+        {0, (uintptr_t) batch[2], 0, 48, 1, TRACE_MALLOC, {}},
+    };
+    const int EXPECTED = sizeof(expected) / sizeof(expected[0]);
+    FILE* file = fopen(path, "rb");
+    assert(file);
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    assert(fread(magic, 1, sizeof(magic), file) == sizeof(magic));
+    assert(!memcmp(magic, TRACE_MAGIC, sizeof(magic)));
+    TraceRecord record;
+    std::vector<TraceRecord> records;
+    int main_records = 0, worker_records = 0;
+    uint64_t main_time = 0, worker_time = 0;
+    byte zeros[sizeof(record.reserved)] = {};
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+        assert(!memcmp(record.reserved, zeros, sizeof(zeros)));
+        if (record.thread == 1) {
+            assert(record.time >= main_time);
+            main_time = record.time;
+            int i = main_records++;
+            if (i < EXPECTED) {
+                assert(record.op == expected[i].op && record.address == expected[i].address);
+                assert(record.old_address == expected[i].old_address && record.size == expected[i].size);
+            } else {
+                assert(record.op == TRACE_FREE && i < EXPECTED + 3);
+            }
+        } else {
+            assert(record.thread == 2 && record.time >= worker_time);
+            worker_time = record.time;
+            assert(record.op == (worker_records % 2 ? TRACE_FREE : TRACE_MALLOC));
+            if (record.op == TRACE_MALLOC)
+                assert(record.size == (uint64_t) (1 + worker_records / 2 % 500));
+            worker_records++;
+        }
+    }
+    fclose(file);
+    unlink(path);
+    assert(main_records == EXPECTED + 3 && worker_records == 3000);
+
+    /* Sorted by time, as the replay reads them, every free names a live
+     * block and no block is handed out twice */
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& x, const TraceRecord& y) { return x.time < y.time; });
+    std::set<uint64_t> live;
+    for (const TraceRecord& r : records) {
+        if (r.op == TRACE_FREE || (r.op == TRACE_REALLOC && r.old_address))
+            assert(live.erase(r.op == TRACE_FREE ? r.address : r.old_address) == 1);
+        if (r.op != TRACE_FREE)
+            assert(live.insert(r.address).second);
+    }
+    assert(live.empty());
+    assert(smalloc_trace_start("/nonexistent/dir/trace") == 0);
+}
+
+/* Totals of a walk, checked against each other and against sheap_info */
+struct Walk {
+    size_t blocks, bytes, heap_bytes, free_blocks, free_bytes, largest_free;
+    size_t mmap_blocks, mmap_bytes, slab_pages;
+    byte* end;          // where the next block of the arena should start
+    int arena;
+    size_t last_free;   // the size of the last block of the arena so far if it is free
+    size_t wilderness;
+};
+
+void walk_block(const HeapBlock* block, void* arg) {
+    Walk* walk = static_cast<Walk*>(arg);
+    byte* start = static_cast<byte*>(block->address);
+    switch (block->kind) {
+        case HEAP_BLOCK_USED:
+        case HEAP_BLOCK_FREE:
+            /* Every arena in address order, the blocks back to back */
+            if (block->arena != walk->arena) {
+                assert(block->arena > walk->arena);
+                walk->wilderness += walk->last_free;
+                walk->arena = block->arena;
+            } else {
+                assert(start == walk->end + _size_meta_data());
+            }
+            walk->end = start + block->size;
+            walk->heap_bytes += block->size + _size_meta_data();
+            walk->blocks++;
+            walk->bytes += block->size;
+            walk->last_free = block->kind == HEAP_BLOCK_FREE ? block->size : 0;
+            if (walk->last_free) {
+                walk->free_blocks++;
+                walk->free_bytes += block->size;
+                if (block->size > walk->largest_free)
+                    walk->largest_free = block->size;
+            }
+            break;
+        case HEAP_BLOCK_MMAP:
+            walk->mmap_blocks++;
+            walk->mmap_bytes += block->size;
+            walk->blocks++;
+            walk->bytes += block->size;
+            break;
+        case HEAP_BLOCK_SLAB:
+            assert(block->slot_size % 16 == 0);
+            walk->slab_pages++;
+            walk->blocks += block->slots_used;
+            walk->bytes += (size_t) block->slots_used * block->slot_size;
+            break;
+        default:
+            assert(false);
+    }
+}
+
+void test_heap_info() {
+    /* Used and free blocks in the heap, slab slots and an mmap'ed block */
+    void* blocks[8];
+    for (int i = 0; i < 8; ++i)
+        blocks[i] = smalloc(1000 * (i + 1));
+    sfree(blocks[1]);
+    sfree(blocks[4]);
+    sfree(blocks[5]);
+    void* slots[20];
+    for (int i = 0; i < 20; ++i)
+        slots[i] = smalloc(8 + i * 10);
+    void* large = smalloc(300 * 1024);
+
+    Walk walk = {};
+    walk.arena = -1;
+    sheap_walk(walk_block, &walk);
+    walk.wilderness += walk.last_free;
+    assert(walk.blocks == _num_allocated_blocks() && walk.bytes == _num_allocated_bytes());
+    assert(walk.free_blocks == _num_free_blocks() && walk.free_bytes == _num_free_bytes());
+    assert(walk.free_blocks >= 2 && walk.mmap_blocks == 1 && walk.slab_pages >= 1);
+    HeapBlock page = find(slots[0]);
+    assert(page.kind == HEAP_BLOCK_SLAB && page.slot_size == susable_size(slots[0]));
+    assert(page.slots_used >= 1);
+    /* Free neighbours are one block */
+    HeapBlock merged = find(blocks[4]);
+    assert(merged.kind == HEAP_BLOCK_FREE && merged.size == 5008 + _size_meta_data() + 6000);
+    assert(find(blocks[5]).kind == 0);
+
+    HeapInfo info;
+    sheap_info(&info);
+    assert(info.free_blocks == walk.free_blocks && info.free_bytes == walk.free_bytes);
+    assert(info.largest_free_block == walk.largest_free);
+    assert(info.wilderness_bytes == walk.wilderness);
+    assert(info.fragmentation == 1.0 - (double) walk.largest_free / walk.free_bytes);
+    assert(info.mmap_blocks == 1 && info.mmap_bytes == walk.mmap_bytes);
+    assert(info.heap_bytes == walk.heap_bytes);
+
+    /* The bins cover every free block, in increasing size */
+    assert(info.bins > 0 && info.bins <= HEAP_INFO_BINS);
+    size_t bin_blocks = 0, bin_bytes = 0;
+    for (size_t i = 0; i < HEAP_INFO_BINS; ++i) {
+        if (i >= info.bins) {
+            assert(!info.bin_min_size[i] && !info.bin_blocks[i] && !info.bin_bytes[i]);
+            continue;
+        }
+        assert(i == 0 || info.bin_min_size[i] > info.bin_min_size[i - 1] ||
+               info.bin_min_size[i] == SIZE_MAX);
+        assert(info.bin_bytes[i] >= info.bin_blocks[i] * info.bin_min_size[i]);
+        bin_blocks += info.bin_blocks[i];
+        bin_bytes += info.bin_bytes[i];
+    }
+    assert(bin_blocks == info.free_blocks && bin_bytes == info.free_bytes);
+
+    /* Freeing everything leaves no used block and no mmap'ed block */
+    for (int i = 0; i < 8; ++i)
+        if (i != 1 && i != 4 && i != 5)
+            sfree(blocks[i]);
+    for (int i = 0; i < 20; ++i)
+        sfree(slots[i]);
+    sfree(large);
+    walk = Walk();
+    walk.arena = -1;
+    sheap_walk(walk_block, &walk);
+    assert(walk.blocks == walk.free_blocks && walk.mmap_blocks == 0);
+    sheap_info(&info);
+    assert(info.mmap_blocks == 0 && info.mmap_bytes == 0);
+    assert(info.free_blocks == walk.free_blocks && info.free_bytes == walk.free_bytes);
+}
+
+/* How many of the whole pages between start and end are resident */
+size_t resident_pages(void* start, void* end) {
+    const uintptr_t PAGE = 4096;
+    uintptr_t first = ((uintptr_t) start + PAGE - 1) & ~(PAGE - 1);
+    uintptr_t last = (uintptr_t) end & ~(PAGE - 1);
+    if (first >= last)
+        return 0;
+    size_t pages = (last - first) / PAGE;
+    unsigned char* vec = static_cast<unsigned char*>(malloc(pages));
+    assert(vec && !mincore((void*) first, last - first, vec));
+    size_t resident = 0;
+    for (size_t i = 0; i < pages; ++i)
+        resident += vec[i] & 1;
+    free(vec);
+    return resident;
+}
+
+void test_trim() {
+    /* Freeing the top of the heap gives back all but less than the trim
+     * threshold and a growth step (128 KiB each). The blocks stay under
+     * the mmap threshold of every build */
+    const int BLOCKS = 32;
+    const size_t SIZE = 60000;
+    void* blocks[BLOCKS];
+    for (int round = 0; round < 2; ++round) {
+        HeapInfo before;
+        sheap_info(&before);
+        for (int i = 0; i < BLOCKS; ++i) {
+            blocks[i] = smalloc(SIZE);
+            fill(blocks[i], SIZE, i);
+        }
+        HeapInfo grown;
+        sheap_info(&grown);
+        assert(grown.heap_bytes >= before.heap_bytes + BLOCKS * SIZE);
+        for (int i = BLOCKS - 1; i >= 0; --i) {
+            assert(check(blocks[i], SIZE, i));
+            sfree(blocks[i]);
+        }
+        HeapInfo after;
+        sheap_info(&after);
+        byte* kept = static_cast<byte*>(blocks[0]) + 256 * 1024 + 4096;
+        byte* end = static_cast<byte*>(blocks[BLOCKS - 1]) + SIZE;
+        if (round == 0) {
+            assert(after.trimmed_bytes > grown.trimmed_bytes);
+            assert(after.heap_bytes < before.heap_bytes + 256 * 1024 + 4096);
+            assert(resident_pages(kept, end) == 0);
+            /* The next round grows back into the trimmed pages */
+            assert(smallopt(M_TRIM_THRESHOLD, 0));
+        } else {
+            /* M_TRIM_THRESHOLD 0 never trims */
+            assert(after.trimmed_bytes == grown.trimmed_bytes);
+            assert(after.heap_bytes == grown.heap_bytes);
+            assert(resident_pages(kept, end) > 0);
+        }
+    }
+
+    /* Merged free blocks inside the heap give their pages back, the used
+     * blocks around them keep theirs */
+    assert(smallopt(M_TRIM_THRESHOLD, 128 * 1024));
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 8; ++i) {
+            blocks[i] = smalloc(SIZE);
+            fill(blocks[i], SIZE, i);
+        }
+        HeapInfo before;
+        sheap_info(&before);
+        for (int i = 1; i < 6; ++i)
+            sfree(blocks[i]);
+        HeapInfo after;
+        sheap_info(&after);
+        byte* start = static_cast<byte*>(blocks[1]) + 4096;
+        byte* end = static_cast<byte*>(blocks[5]) + SIZE;
+        if (round == 0) {
+            assert(after.madvised_bytes >= before.madvised_bytes + 4 * SIZE);
+            assert(resident_pages(start, end) == 0);
+            assert(smallopt(M_MADVISE_THRESHOLD, 0));
+        } else {
+            /* M_MADVISE_THRESHOLD 0 never madvises */
+            assert(after.madvised_bytes == before.madvised_bytes);
+            assert(resident_pages(start, end) > 0);
+        }
+        assert(check(blocks[0], SIZE, 0) && check(blocks[6], SIZE, 6));
+        for (int i = 1; i < 6; ++i)
+            blocks[i] = smalloc(SIZE);
+        for (int i = 0; i < 8; ++i)
+            sfree(blocks[i]);
+    }
+}
+
+void test_mmap_cache() {
+    const size_t MIB = 1024 * 1024;
+    size_t initial = live_bytes();
+    HeapInfo info, before;
+
+    /* A freed large block stays mapped and serves the next request of its
+     * size, which may be a bit smaller */
+    void* a = smalloc(MIB);
+    fill(a, MIB, 1);
+    sfree(a);
+    sheap_info(&before);
+    assert(before.mmap_cache_bytes > MIB && before.mmap_blocks == 0);
+    void* b = smalloc(MIB - 100000);
+    sheap_info(&info);
+    assert(b == a && info.mmap_cache_hits == before.mmap_cache_hits + 1);
+    assert(info.mmap_cache_bytes == 0 && info.mmap_blocks == 1);
+
+    /* A region that was used still reads as zeros through scalloc */
+    sfree(b);
+    byte* c = static_cast<byte*>(scalloc(MIB, 1));
+    assert(c == a && is_zero(c, MIB));
+
+    /* One much larger or much smaller does not take it */
+    sfree(c);
+    sheap_info(&before);
+    void* larger = smalloc(2 * MIB);
+    void* smaller = smalloc(MIB / 2);
+    sheap_info(&info);
+    assert(larger != a && smaller != a);
+    assert(info.mmap_cache_misses == before.mmap_cache_misses + 2);
+    assert(info.mmap_cache_bytes == before.mmap_cache_bytes);
+    sfree(larger);
+    sfree(smaller);
+
+    /* Past M_MMAP_CACHE_MAX the regions cached first are unmapped first */
+    assert(smallopt(M_MMAP_CACHE_MAX, 0));
+    sheap_info(&info);
+    assert(info.mmap_cache_bytes == 0);
+    assert(smallopt(M_MMAP_CACHE_MAX, 3 * MIB + 3 * 8192));
+    void* regions[5];
+    for (int i = 0; i < 5; ++i)
+        regions[i] = smalloc(MIB);
+    for (int i = 0; i < 5; ++i)
+        sfree(regions[i]);
+    sheap_info(&before);
+    assert(before.mmap_cache_bytes <= 3 * MIB + 3 * 8192 && before.mmap_cache_bytes > 2 * MIB);
+    for (int i = 0; i < 3; ++i) {
+        void* p = smalloc(MIB);
+        assert(p == regions[2] || p == regions[3] || p == regions[4]);
+        regions[i] = p;
+    }
+    sheap_info(&info);
+    assert(info.mmap_cache_bytes == 0 && info.mmap_cache_hits == before.mmap_cache_hits + 3);
+    for (int i = 0; i < 3; ++i)
+        sfree(regions[i]);
+
+    /* 0 unmaps every block as it is freed */
+    assert(smallopt(M_MMAP_CACHE_MAX, 0));
+    sfree(smalloc(MIB));
+    sheap_info(&info);
+    assert(info.mmap_cache_bytes == 0);
+    assert(!smallopt(M_MMAP_CACHE_MAX, -1));
+    assert(live_bytes() == initial);
+}
+
+void test_mremap() {
+    const size_t MIB = 1024 * 1024;
+    size_t initial = live_bytes();
+    HeapInfo before, info;
+
+    /* A large block grows by remapping its pages: no new block is
+     * allocated for it, and the data stays */
+    byte* p = static_cast<byte*>(smalloc(200 * 1024));
+    fill(p, 200 * 1024, 1);
+    sheap_info(&before);
+    size_t size = 200 * 1024;
+    for (size_t grow = MIB; grow <= 64 * MIB; grow *= 2) {
+        p = static_cast<byte*>(srealloc(p, grow));
+        assert(p && is_aligned(p, 16) && susable_size(p) >= grow);
+        assert(check(p, 200 * 1024, 1));
+        fill(p + size, grow - size, 2);
+        size = grow;
+    }
+    sheap_info(&info);
+    assert(info.mmap_blocks == 1 && info.mmap_bytes >= 64 * MIB);
+    assert(info.mmap_cache_hits + info.mmap_cache_misses == before.mmap_cache_hits + before.mmap_cache_misses);
+
+    /* Shrinking unmaps the pages past the new size and stays in place */
+    byte* shrunk = static_cast<byte*>(srealloc(p, 3 * MIB));
+    assert(shrunk == p && check(p, 200 * 1024, 1));
+    unsigned char vec;
+    void* past = (void*) ((uintptr_t) (p + 4 * MIB) & ~(uintptr_t) 4095);
+    assert(mincore(past, 4096, &vec) == -1 && errno == ENOMEM);
+    shrunk = static_cast<byte*>(srealloc(p, 1000));
+    assert(shrunk == p && check(p, 1000, 1));
+    sheap_info(&info);
+    assert(info.mmap_blocks == 1 && info.mmap_bytes == 1008);
+    sfree(p);
+
+    /* A page aligned block stays page aligned when it moves */
+    byte* aligned = static_cast<byte*>(smemalign(4096, 300 * 1024));
+    fill(aligned, 300 * 1024, 3);
+    void* blocker = smalloc(300 * 1024);  // may sit right after it
+    aligned = static_cast<byte*>(srealloc(aligned, 8 * MIB));
+    assert(aligned && is_aligned(aligned, 4096) && check(aligned, 300 * 1024, 3));
+    sfree(aligned);
+    sfree(blocker);
+    assert(live_bytes() == initial);
+}
+
+void test_sized_free() {
+    size_t initial = live_bytes();
+
+    /* srealloc within susable_size keeps the block where it is */
+    const size_t USABLE_SIZES[] = {40, 100, 1000, 300 * 1024};
+    for (size_t size : USABLE_SIZES) {
+        void* p = smalloc(size);
+        size_t usable = susable_size(p);
+        assert(usable >= size);
+        fill(p, usable, 4);
+        assert(srealloc(p, usable) == p && check(p, usable, 4));
+        sfree_sized(p, size);
+    }
+    assert(susable_size(nullptr) == 0);
+    sfree_sized(nullptr, 10);
+    assert(live_bytes() == initial);
+
+    /* With the thread cache, a slot goes to the magazine of the size passed,
+     * which may be smaller than the slot */
+    assert(smallopt(M_TCACHE, 1));
+    initial = live_bytes();
+    void* p = smalloc(40);
+    sfree_sized(p, 40);
+    assert(smalloc(33) == p);
+    sfree_sized(p, 48);
+    assert(smalloc(48) == p);
+    sfree_sized(p, 20);
+    assert(smalloc(20) == p);
+    void* q = smalloc(100);
+    assert(susable_size(q) == 112);
+    sfree_sized(q, 1);
+    assert(smalloc(16) == q);
+    sfree_sized(q, 16);
+    sfree_sized(p, 20);
+
+    /* Heap and mmap'ed blocks take the sfree path */
+    void* heap = smalloc(5000);
+    void* large = smalloc(300 * 1024);
+    sfree_sized(heap, 5000);
+    sfree_sized(large, 300 * 1024);
+    assert(smallopt(M_TCACHE, 0));
+    assert(live_bytes() == initial);
+}
+
+void test_reserved_heap() {
+    /* The main heap is a range of its own: it grows past the 256 MiB of
+     * the other arenas in place, without moving the program break */
+    void* brk = sbrk(0);
+    const int BLOCKS = 5000;
+    const size_t SIZE = 60000;
+    void** blocks = static_cast<void**>(smalloc(BLOCKS * sizeof(void*)));
+    for (int i = 0; i < BLOCKS; ++i) {
+        blocks[i] = smalloc(SIZE);
+        assert(blocks[i] && is_aligned(blocks[i], 16));
+        fill(blocks[i], 64, i);
+        if (i > 0)
+            assert(blocks[i] == static_cast<byte*>(blocks[i - 1]) + SIZE + _size_meta_data());
+    }
+    assert(arena_of(blocks[0]) == 0 && arena_of(blocks[BLOCKS - 1]) == 0);
+    HeapInfo info;
+    sheap_info(&info);
+    assert(info.heap_bytes >= (size_t) BLOCKS * SIZE && info.heap_bytes > 256 * 1024 * 1024);
+    assert(sbrk(0) == brk);
+
+    /* The range past the top of the heap is reserved, not committed */
+    byte* past = static_cast<byte*>(blocks[0]) - _size_meta_data() + info.heap_bytes + 4096;
+    past = (byte*) ((uintptr_t) past & ~(uintptr_t) 4095);
+    pid_t child = fork();
+    if (!child) {
+        signal(SIGSEGV, SIG_DFL);  // sanitizers catch it otherwise
+        *past = 1;
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+    for (int i = 0; i < BLOCKS; ++i) {
+        assert(check(blocks[i], 64, i));
+        sfree(blocks[i]);
+    }
+    sfree(blocks);
+    assert(sbrk(0) == brk);
+}
+
+void* thread_worker(void* arg) {
+    void** shared = static_cast<void**>(arg);
+    byte seed = (byte) (uintptr_t) shared[0];
+    void* mine[500];
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 500; ++i) {
+            mine[i] = smalloc(8 + (i * 37 + round) % 600);
+            fill(mine[i], 8, seed + i);
+        }
+        for (int i = 0; i < 500; ++i) {
+            assert(check(mine[i], 8, seed + i));
+            sfree(mine[i]);
+        }
+    }
+    /* Blocks of the main thread, freed from this one */
+    for (int i = 1; i < 100; ++i)
+        sfree(shared[i]);
+    return nullptr;
+}
+
+void test_threads() {
+    assert(smallopt(M_ARENAS, 4));
+    size_t initial = live_bytes();
+    const int THREADS = 8;
+    void* shared[THREADS][100];
+    pthread_t threads[THREADS];
+
+    for (int t = 0; t < THREADS; ++t) {
+        shared[t][0] = (void*) (uintptr_t) (t * 31);
+        for (int i = 1; i < 100; ++i)
+            shared[t][i] = smalloc(16 * i);
+        assert(!pthread_create(&threads[t], nullptr, thread_worker, shared[t]));
+    }
+    for (int t = 0; t < THREADS; ++t)
+        pthread_join(threads[t], nullptr);
+    assert(live_bytes() == initial);
+}
+
+void* full_arena_worker(void*) {
+    /* Fill the 256 MiB range of this thread's arena with blocks under the
+     * mmap threshold (64 KiB in some builds): the last ones come from the
+     * main arena */
+    const int BLOCKS = 4800;
+    void** blocks = static_cast<void**>(smalloc(BLOCKS * sizeof(void*)));
+    for (int i = 0; i < BLOCKS; ++i)
+        assert((blocks[i] = smalloc(60 * 1024)));
+    assert(arena_of(blocks[0]) == 1 && arena_of(blocks[BLOCKS - 1]) == 0);
+
+    /* A block left in the full arena moves to the main one to grow */
+    byte* q = static_cast<byte*>(smalloc(1000));
+    assert(arena_of(q) == 1);
+    fill(q, 1000, 5);
+    q = static_cast<byte*>(srealloc(q, 50000));
+    assert(q && arena_of(q) == 0 && check(q, 1000, 5));
+    sfree(q);
+    for (int i = 0; i < BLOCKS; ++i)
+        sfree(blocks[i]);
+    sfree(blocks);
+    return nullptr;
+}
+
+void test_arena_fallback() {
+    assert(smallopt(M_ARENAS, 2));
+    size_t initial = live_bytes();
+    void* mine = smalloc(1000);  // the main thread takes arena 0
+    assert(arena_of(mine) == 0);
+    pthread_t thread;
+    assert(!pthread_create(&thread, nullptr, full_arena_worker, nullptr));
+    pthread_join(thread, nullptr);
+    sfree(mine);
+    assert(live_bytes() == initial);
+}
+
+void count_slab_pages(const HeapBlock* block, void* arg) {
+    if (block->kind == HEAP_BLOCK_SLAB)
+        ++*static_cast<size_t*>(arg);
+}
+
+const int SLOTS = 1000;
+
+void* slab_worker(void* arg) {
+    void** slots = static_cast<void**>(arg);
+    /* Half of the main thread's slots, freed from this thread */
+    for (int i = 0; i < SLOTS; i += 2)
+        sfree(slots[i]);
+    /* Slots of this thread come from the pages of its own arena */
+    for (int i = 0; i < SLOTS; i += 2) {
+        slots[i] = smalloc(1 + i % 256);
+        HeapBlock page = find(slots[i]);
+        assert(page.kind == HEAP_BLOCK_SLAB && page.arena == 1);
+        fill(slots[i], 1 + i % 256, i);
+    }
+    return nullptr;
+}
+
+void test_slabs() {
+    assert(smallopt(M_ARENAS, 2));
+    size_t initial = live_bytes();
+    size_t blocks = _num_allocated_blocks();
+    void* slots[SLOTS];
+
+    /* Up to 256 bytes a request gets a slot of its 16 bytes class */
+    for (int i = 0; i < SLOTS; ++i) {
+        size_t size = 1 + i % 256;
+        slots[i] = smalloc(size);
+        HeapBlock page = find(slots[i]);
+        assert(page.kind == HEAP_BLOCK_SLAB && page.arena == 0);
+        assert(page.slot_size == (size + 15) / 16 * 16);
+        assert(susable_size(slots[i]) == page.slot_size);
+        assert(is_aligned(slots[i], 16));
+        fill(slots[i], size, i);
+    }
+    assert(_num_allocated_blocks() == blocks + SLOTS);
+    for (int i = 0; i < SLOTS; ++i)
+        assert(check(slots[i], 1 + i % 256, i));
+
+    /* Another arena frees slots of this one and takes slots of its own */
+    pthread_t thread;
+    assert(!pthread_create(&thread, nullptr, slab_worker, slots));
+    pthread_join(thread, nullptr);
+    for (int i = 0; i < SLOTS; ++i)
+        assert(check(slots[i], 1 + i % 256, i));
+    for (int i = 0; i < SLOTS; ++i)
+        sfree(slots[i]);
+    assert(live_bytes() == initial && _num_allocated_blocks() == blocks);
+
+    /* Empty pages go back to the pool, each arena keeps at most one per class */
+    size_t pages = 0;
+    sheap_walk(count_slab_pages, &pages);
+    assert(pages <= 2 * 16);
+
+    /* M_SLAB_MAX bounds the slots, 0 turns them off */
+    assert(smallopt(M_SLAB_MAX, 64));
+    void* heap = smalloc(65);
+    assert(find(heap).kind == HEAP_BLOCK_USED);
+    sfree(heap);
+    assert(smallopt(M_SLAB_MAX, 0));
+    heap = smalloc(16);
+    assert(find(heap).kind == HEAP_BLOCK_USED);
+    sfree(heap);
+    assert(!smallopt(M_SLAB_MAX, 257));
+    assert(live_bytes() == initial);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static int failures = 0;
+
+static void callTestFunction(void (*func)()) {
+    if (!fork()) {  // test as son, to get a clear heap
+        func();
+        exit(0);
+    } else {		// father waits for son before continuing to next test
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status) {
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+            failures++;
+        }
+    }
+}
+
+int main()
+{
+    std::cout << "test_alignment" << std::endl;
+    callTestFunction(test_alignment);
+    std::cout << "test_calloc_zero" << std::endl;
+    callTestFunction(test_calloc_zero);
+    std::cout << "test_realloc_data" << std::endl;
+    callTestFunction(test_realloc_data);
+    std::cout << "test_batch" << std::endl;
+    callTestFunction(test_batch);
+    std::cout << "test_region" << std::endl;
+    callTestFunction(test_region);
+    std::cout << "test_fastbins" << std::endl;
+    callTestFunction(test_fastbins);
+    std::cout << "test_tcache" << std::endl;
+    callTestFunction(test_tcache);
+    std::cout << "test_trace" << std::endl;
+    callTestFunction(test_trace);
+    std::cout << "test_heap_info" << std::endl;
+    callTestFunction(test_heap_info);
+    std::cout << "test_trim" << std::endl;
+    callTestFunction(test_trim);
+    std::cout << "test_mmap_cache" << std::endl;
+    callTestFunction(test_mmap_cache);
+    std::cout << "test_mremap" << std::endl;
+    callTestFunction(test_mremap);
+    std::cout << "test_sized_free" << std::endl;
+    callTestFunction(test_sized_free);
+    std::cout << "test_reserved_heap" << std::endl;
+    callTestFunction(test_reserved_heap);
+    std::cout << "test_threads" << std::endl;
+    callTestFunction(test_threads);
+    std::cout << "test_slabs" << std::endl;
+    callTestFunction(test_slabs);
+    std::cout << "test_arena_fallback" << std::endl;
+    callTestFunction(test_arena_fallback);
+    return failures;
+}